@@ -16,26 +16,91 @@
 Actuator::Actuator(uint8_t id, bool isActiveHigh)
 {
 	mId = id;
-	mChannels = 0;
 	mActiveHigh = isActiveHigh;
-	pinMode(A8+mId, OUTPUT);
-	digitalWrite(A8+mId, mActiveHigh ? LOW : HIGH);
+	mIsOn = false;
+	mInputCount = 0;
+	memset(mTruth, 0, sizeof(mTruth));
 }
 
 
-void Actuator::activate(uint8_t adcChannel)
+void Actuator::setInputs(const uint8_t * channels, uint8_t count)
 {
-	mChannels |= 1 << adcChannel;
-	digitalWrite(A8+mId, mActiveHigh ? HIGH : LOW);
+	mInputCount = count > ACTUATOR_MAX_INPUTS ? ACTUATOR_MAX_INPUTS : count;
+	memcpy(mInputs, channels, mInputCount);
 }
 
 
-void Actuator::deactivate(uint8_t adcChannel)
+void Actuator::setRule(uint8_t rule, uint8_t priority)
 {
-	mChannels &= ~(1 << adcChannel);
+	uint8_t priorityBit = 0;
 
-	if(!mChannels)
+	if(priority != NO_CHANNEL)
 	{
-		digitalWrite(A8+mId, mActiveHigh ? LOW : HIGH);
+		uint8_t s = 0;
+
+		while(s < mInputCount && mInputs[s] != priority)
+			s++;
+
+		if(s == mInputCount && mInputCount < ACTUATOR_MAX_INPUTS)
+			mInputs[mInputCount++] = priority;
+
+		if(s < mInputCount)
+			priorityBit = 1 << s;
+	}
+
+	// the voters are all the inputs but the priority one
+
+	uint8_t voters = (mInputCount == 8 ? 0xFF : (1 << mInputCount) - 1) & ~priorityBit;
+	uint8_t total = 0;
+
+	for(uint8_t v = voters; v; v &= v - 1)
+		total++;
+
+	for(int m = 0; m < 256; m++)
+	{
+		uint8_t n = 0;
+
+		for(uint8_t v = m & voters; v; v &= v - 1)
+			n++;
+
+		bool on;
+
+		switch(rule)
+		{
+		case combine_and:		on = total && n == total; break;
+		case combine_majority:	on = 2 * n > total; break;
+		default:				on = n > 0; break;
+		}
+
+		if(m & priorityBit)
+			on = true;
+
+		if(on)
+			mTruth[m >> 3] |= 1 << (m & 7);
+		else
+			mTruth[m >> 3] &= ~(1 << (m & 7));
 	}
 }
+
+
+void Actuator::takeIndex(const Actuator & from)
+{
+	mInputCount = from.mInputCount;
+	memcpy(mInputs, from.mInputs, sizeof(mInputs));
+	memcpy(mTruth, from.mTruth, sizeof(mTruth));
+}
+
+
+bool Actuator::evaluate(const uint8_t * demand)
+{
+	uint8_t m = 0;
+
+	for(uint8_t s = 0; s < mInputCount; s++)
+	{
+		uint8_t ch = mInputs[s];
+		m |= ((demand[ch >> 3] >> (ch & 7)) & 1) << s;
+	}
+
+	mIsOn = (mTruth[m >> 3] >> (m & 7)) & 1;
+	return mIsOn;
+}
@@ -15,76 +15,91 @@
 #define ACTUATOR_H_
 
 #include <Arduino.h>
+#include "shield.h"
+
+#define ACTUATOR_MAX_INPUTS	8		// channels that may drive one actuator
+#define NO_CHANNEL			0xFF
 
  /*! @brief Implements an actuator.
  *
  * This class implements control of the relay that in its turn controls the pump. Any of the
- * temperature measurement channels can activate the actuator. The actuator is released when the
- * last of the channels releases it.
+ * temperature measurement channels can drive the actuator. How the demands of the channels
+ * combine is the rule of the actuator, OR by default: the actuator is released when the last
+ * of the channels releases it.
  */
 class Actuator
  {
  public:
-	 Actuator() : mId(0), mChannels(0), mActiveHigh(true) {};
+
+	 /*! @brief Enumerates how the channels driving the actuator combine. */
+	 typedef enum CombineRule {
+		 combine_or,			/*!< on if any of the channels wants it on */
+		 combine_and,			/*!< on if all of the channels want it on */
+		 combine_majority,		/*!< on if more than half of the channels want it on */
+		 COMBINE_RULE_COUNT
+	 } CombineRule_t;
+
+ public:
+	 Actuator() : mId(0), mActiveHigh(true), mIsOn(false), mInputCount(0) { memset(mTruth, 0, sizeof(mTruth)); };
 	 Actuator(uint8_t id, bool isActiveHigh);
 	 virtual ~Actuator(){};
 
 	 /*!
-	  * @brief Activates the actuator (the corresponding pump)
-	  *
-	  * Sets the digital output low. It shorts the relay primary coil to ground
-	  * causing it to trigger (the other terminal is connected to Vdd).
+	  * @brief Sets the channels driving the actuator
 	  *
-	  * It sets the bit of mChannels corresponding to the requesting ADC channel in
-	  * order to keep track of when all the channels release the actuator.
+	  * This is the actuator->channels index, built when the configuration is loaded. So
+	  * evaluate() only looks at these channels.
 	  *
-	  * @param[in] adcChannel Which channel triggers the actuator
+	  * @param[in] channels the channel ids, no more than ACTUATOR_MAX_INPUTS
+	  * @param[in] count    number of channels
 	  */
-	 void activate(uint8_t adcChannel);
+	 void setInputs(const uint8_t * channels, uint8_t count);
 
 	 /*!
-	  * @brief Deactivates the actuator (the corresponding pump) when the last ADC channel releases
+	  * @brief Sets the combination rule and rebuilds the truth table
 	  *
-	  * It resets the bit of mChannels corresponding to the requesting ADC channel.
+	  * Has to be called after setInputs.
 	  *
-	  * When the last bit is reset (mChannels == 0) sets the digital output high. It sets Vdd to both
-	  * terminals of the relay primary coil causing it to open (the other terminal is connected to Vdd).
-	  *
-	  * @param[in] adcChannel Which channel releases the actuator
+	  * @param[in] rule     one of the CombineRule_t
+	  * @param[in] priority the channel that forces the actuator on whatever the rule says, e.g.
+	  *                     the outside channel at -40C. NO_CHANNEL for none. It is added to the
+	  *                     inputs if it is not one of them
 	  */
-	 void deactivate(uint8_t adcChannel);
+	 void setRule(uint8_t rule, uint8_t priority);
 
 	 /*!
-	  * @brief Deactivates the actuator (the corresponding pump) when the last ADC channel releases
+	  * @brief Takes the inputs and the truth table of another actuator, not its state
 	  *
-	  * It resets the bit of mChannels corresponding to the requesting ADC channel.
+	  * The index is built in a staging actuator and taken over in one go, see
+	  * Storage::buildIndex. Call with the interrupts off, the bank evaluates the
+	  * actuators in its ISR.
+	  */
+	 void takeIndex(const Actuator & from);
+
+	 /*!
+	  * @brief Decides whether the actuator is on
 	  *
-	  * When the last bit is reset (mChannels == 0) sets the digital output high. It sets Vdd to both
-	  * terminals of the relay primary coil causing it to open (the other terminal is connected to Vdd).
+	  * The demands of the input channels are gathered into a bit mask, one bit per input,
+	  * and the mask is looked up in the 256 entry truth table of the rule. No branching on
+	  * the rule, the same cost for every rule.
 	  *
-	  * @param[in] adcChannel Which channel releases the actuator
+	  * @param[in] demand bit mask of all the channels, set for the channels that want their
+	  *                   actuators on
+	  * @return    The new state, also returned by isOn() from now on
 	  */
-	 bool isOn() { return mChannels != 0; }
+	 bool evaluate(const uint8_t * demand);
+
+	 /*!
+	  * @brief The state found by the latest evaluate
+	  */
+	 bool isOn() { return mIsOn; }
+
+	 bool isActiveHigh() { return mActiveHigh; }		//!< see mActiveHigh
 
  private:
 
 	 uint8_t mId;			//!< The id of the actual digital output. 0..7 (pins A8...A15)
 
-	 /*!
-	  * @brief The bit mask of the ADC channels controlling this actuator
-	  *
-	  * Depending on the configuration (config.txt), the same actuator may be driven by more than one
-	  * ADC channel. This is for example the case when the same contour runs through two neighboring
-	  * rooms, each having its own temperature sensor (ADC). In this case any of the rooms may activate
-	  * the actuator. It is the OR rule that applies.
-	  *
-	  * Another example is a very-cold channel. For example at -40C outside, all the actuators may
-	  * be activated regardless of the current room temperature.
-	  *
-	  * This is a bit mask. The corresponding ADC bit is set by activate() and reset by deactivate()
-	  */
-	 uint8_t mChannels;
-
 	 /*!
 	  * @brief	What to do with the digital pin when activating
 	  *
@@ -98,6 +113,28 @@ class Actuator
 	  * activate.
 	  */
 	 bool mActiveHigh;
+
+	 bool mIsOn;
+
+	 /*!
+	  * @brief The ADC channels driving this actuator
+	  *
+	  * Depending on the configuration (config.txt), the same actuator may be driven by more than one
+	  * ADC channel. This is for example the case when the same contour runs through two neighboring
+	  * rooms, each having its own temperature sensor (ADC). In this case any of the rooms may activate
+	  * the actuator. It is the OR rule that applies.
+	  *
+	  * Another example is a very-cold channel. For example at -40C outside, all the actuators may
+	  * be activated regardless of the current room temperature. That is the priority channel of
+	  * setRule.
+	  *
+	  * The position of the channel in this array is its bit in the truth table index.
+	  */
+	 uint8_t mInputs[ACTUATOR_MAX_INPUTS];
+
+	 uint8_t mInputCount;
+
+	 uint8_t mTruth[256 / 8];	//!< bit m is the state for the input mask m
  };
 
 
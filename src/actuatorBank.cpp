@@ -0,0 +1,253 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Actuator bank class
+ *
+ * Created on: 		2016-10-12
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+#include "Arduino.h"
+#include <util/atomic.h>
+#include "actuatorBank.h"
+#include "actuator.h"
+
+extern Actuator Actuators[ACTUATOR_COUNT];
+extern ActuatorBank Bank;
+
+
+ISR(TIMER5_COMPA_vect)
+{
+	Bank.onTick();
+}
+
+
+ActuatorBank::ActuatorBank()
+{
+	mState = 0;
+	mActiveLow = 0;
+	mDemand = NULL;
+	mPhase = 0;
+
+	memset(mPwmChannels, 0, sizeof(mPwmChannels));
+	memset((void *)mPwmOut, 0, sizeof(mPwmOut));
+	memset(mDutyTicks, 0, sizeof(mDutyTicks));
+	memset((void *)mToggles, 0, sizeof(mToggles));
+	memset((void *)mOnTicks, 0, sizeof(mOnTicks));
+
+	memset(mOnSince, 0, sizeof(mOnSince));
+	memset(mOnTime, 0, sizeof(mOnTime));
+	memset(mActuatorToggles, 0, sizeof(mActuatorToggles));
+}
+
+
+void ActuatorBank::begin()
+{
+	mState = 0;
+	mActiveLow = 0;
+
+	for( uint8_t i = 0; i < ACTUATOR_COUNT; i++ )
+	{
+		if( !Actuators[i].isActiveHigh() )
+			mActiveLow |= 1 << i;
+	}
+
+	// the levels first, then the direction. The relays never see a glitch
+
+	PORTK = mActiveLow;
+	DDRK = 0xFF;
+
+	// Timer5 in CTC mode, 16MHz / 1024 / 15625 = 1 Hz
+
+	TCCR5A = 0;
+	TCCR5B = (1 << WGM52) | (1 << CS52) | (1 << CS50);
+	OCR5A = 15624;
+	TCNT5 = 0;
+	TIMSK5 |= (1 << OCIE5A);
+}
+
+
+
+void ActuatorBank::commit(const uint8_t * demand)
+{
+	// the tick commits as well, it must not come in between
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		mDemand = demand;
+
+		// the channels under PWM take their output instead of the demand
+
+		uint8_t merged[CHANNEL_MASK_SZ];
+
+		for( uint8_t i = 0; i < CHANNEL_MASK_SZ; i++ )
+			merged[i] = (demand[i] & ~mPwmChannels[i]) | (mPwmOut[i] & mPwmChannels[i]);
+
+		uint8_t state = 0;
+
+		for( uint8_t i = 0; i < ACTUATOR_COUNT; i++ )
+		{
+			if( Actuators[i].evaluate(merged) )
+				state |= 1 << i;
+		}
+
+		if( state != mState )
+		{
+			// timestamp the edges for the duty accounting
+
+			unsigned long now = millis();
+			uint8_t changed = state ^ mState;
+
+			for( uint8_t i = 0; i < ACTUATOR_COUNT; i++ )
+			{
+				if( !(changed & (1 << i)) )
+					continue;
+
+				if( state & (1 << i) )
+					mOnSince[i] = now;
+				else
+					mOnTime[i] += now - mOnSince[i];
+
+				mActuatorToggles[i]++;
+			}
+
+			mState = state;
+			PORTK = state ^ mActiveLow;
+		}
+	}
+}
+
+
+// ActuatorBank::setPwm *********************************************
+// ******************************************************************
+//
+void ActuatorBank::setPwm(uint8_t channel, bool isPwm)
+{
+	uint8_t bit = 1 << (channel & 7);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if( isPwm )
+			mPwmChannels[channel >> 3] |= bit;
+		else
+			mPwmChannels[channel >> 3] &= ~bit;
+	}
+}
+
+
+// ActuatorBank::takeActivity ***************************************
+// ******************************************************************
+//
+uint8_t ActuatorBank::takeActivity(uint8_t channel, uint16_t * onTicks)
+{
+	uint8_t n;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		n = mToggles[channel];
+		mToggles[channel] = 0;
+		*onTicks = mOnTicks[channel];
+		mOnTicks[channel] = 0;
+	}
+	return n;
+}
+
+
+// ActuatorBank::takeOnTime *****************************************
+// ******************************************************************
+// the period still open is cut at now and goes on from there
+//
+unsigned long ActuatorBank::takeOnTime(uint8_t actuator, unsigned long now, uint16_t * toggles)
+{
+	unsigned long t;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		t = mOnTime[actuator];
+
+		if( mState & (1 << actuator) )
+		{
+			t += now - mOnSince[actuator];
+			mOnSince[actuator] = now;
+		}
+		mOnTime[actuator] = 0;
+
+		*toggles = mActuatorToggles[actuator];
+		mActuatorToggles[actuator] = 0;
+	}
+	return t;
+}
+
+
+// ActuatorBank::peekOnTime ****************************************
+// ******************************************************************
+//
+unsigned long ActuatorBank::peekOnTime(uint8_t actuator, unsigned long now, uint16_t * toggles)
+{
+	unsigned long t;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		t = mOnTime[actuator];
+
+		if( mState & (1 << actuator) )
+			t += now - mOnSince[actuator];
+
+		*toggles = mActuatorToggles[actuator];
+	}
+	return t;
+}
+
+
+// ActuatorBank::restoreOnTime **************************************
+// ******************************************************************
+//
+void ActuatorBank::restoreOnTime(uint8_t actuator, unsigned long onTime, uint16_t toggles)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		mOnTime[actuator] += onTime;
+		mActuatorToggles[actuator] += toggles;
+	}
+}
+
+
+// ActuatorBank::onTick *********************************************
+// ******************************************************************
+// the window of the channel i starts (i % 8) / 8 of the window later
+// than the one of the channel 0
+//
+void ActuatorBank::onTick()
+{
+	if( ++mPhase >= PWM_WINDOW )
+		mPhase = 0;
+
+	for( uint8_t ch = 0; ch < CHANNEL_COUNT; ch++ )
+	{
+		uint8_t bit = 1 << (ch & 7);
+
+		if( !(mPwmChannels[ch >> 3] & bit) )
+			continue;
+
+		uint16_t phase = mPhase + (uint16_t)(ch & 7) * (PWM_WINDOW / 8);
+		if( phase >= PWM_WINDOW )
+			phase -= PWM_WINDOW;
+
+		bool isOn = phase < mDutyTicks[ch];
+
+		if( isOn )
+			mOnTicks[ch]++;
+
+		if( isOn != ((mPwmOut[ch >> 3] & bit) != 0) )
+		{
+			mPwmOut[ch >> 3] ^= bit;
+			mToggles[ch]++;
+		}
+	}
+
+	if( mDemand )
+		commit(mDemand);
+}
@@ -0,0 +1,143 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Actuator bank class
+ *
+ * Created on: 		2016-10-12
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef ACTUATORBANK_H_
+#define ACTUATORBANK_H_
+
+#include <Arduino.h>
+#include "shield.h"
+#include "pidControl.h"
+
+#define PWM_WINDOW		240		// the slow PWM period, in ticks of 1 s
+
+#if ACTUATOR_COUNT != 8
+#error "the actuators are the pins A8...A15, i.e. exactly PORTK"
+#endif
+
+/*! @brief Drives all the actuator outputs at once.
+ *
+ * The Actuator objects only decide whether they are on, from the demand of
+ * their channels. They do not touch the pins. Once per tick the owner calls
+ * commit(), which evaluates every actuator, collects the states in a bit mask,
+ * applies the polarity and writes PORTK in one go. So a relay switches at
+ * most once per pass, all the relays switch together, and there is one port
+ * write instead of a digitalWrite per actuator and channel.
+ *
+ * The channels in the proportional or PID mode have a duty cycle instead of
+ * an on/off demand. The bank turns it into slow PWM: Timer5 ticks once a
+ * second, and the channel is on for the first duty * PWM_WINDOW / DUTY_MAX
+ * ticks of every window. The windows of the channels are staggered, so the
+ * relays do not all start together. The tick evaluates and writes the
+ * actuators itself, so the timing does not depend on how long loop() takes.
+ */
+class ActuatorBank
+{
+public:
+	ActuatorBank();
+	virtual ~ActuatorBank() {};
+
+	/*!
+	 * @brief      Takes the polarity from the actuators and switches them all off
+	 *
+	 * Has to be called in the setup by the owner, after the actuators are created.
+	 * Starts Timer5 for the PWM.
+	 */
+	void begin();
+
+	/*!
+	 * @brief      Writes the state of all the actuators to the pins
+	 *
+	 * Shall be called once per loop pass, after the readings are processed. Does
+	 * nothing if no actuator changed.
+	 *
+	 * @param[in]  demand the channels that want their actuators on, see Storage::getDemand
+	 */
+	void commit(const uint8_t * demand);
+
+	/*!
+	 * @brief      The state written by the latest commit
+	 * @return     bit 0 - Actuator 0, bit 7 - actuator 7. Set for on, whatever the polarity
+	 */
+	uint8_t getState() { return mState; }
+
+	/*!
+	 * @brief      Puts the channel under PWM or back to its on/off demand
+	 */
+	void setPwm(uint8_t channel, bool isPwm);
+
+	/*!
+	 * @brief      Sets the duty cycle of a channel under PWM
+	 * @param[in]  duty 0...DUTY_MAX. Takes effect with the next tick
+	 */
+	void setDuty(uint8_t channel, uint8_t duty) { mDutyTicks[channel] = (uint16_t)duty * PWM_WINDOW / DUTY_MAX; }
+
+	/*!
+	 * @brief      The PWM output of a channel, as of the latest tick
+	 */
+	bool getPwmOut(uint8_t channel) { return mPwmOut[channel >> 3] & (1 << (channel & 7)); }
+
+	/*!
+	 * @brief      What the PWM did to the channel since the previous call
+	 * @param[out] onTicks the ticks (s) the channel was on
+	 * @return     Number of PWM edges
+	 */
+	uint8_t takeActivity(uint8_t channel, uint16_t * onTicks);
+
+	/*!
+	 * @brief      How long the actuator was on since the previous call
+	 *
+	 * The on and off edges are timestamped by commit as they happen, so the
+	 * time is exact to the millisecond.
+	 *
+	 * @param[in]  now     millis() of the call
+	 * @param[out] toggles number of the edges since the previous call
+	 * @return     in ms
+	 */
+	unsigned long takeOnTime(uint8_t actuator, unsigned long now, uint16_t * toggles);
+
+	/*!
+	 * @brief      Same as takeOnTime, but the period goes on
+	 */
+	unsigned long peekOnTime(uint8_t actuator, unsigned long now, uint16_t * toggles);
+
+	/*!
+	 * @brief      Adds the on time and the toggles of a checkpoint, after a reset
+	 */
+	void restoreOnTime(uint8_t actuator, unsigned long onTime, uint16_t toggles);
+
+	/*!
+	 * @brief      Advances the PWM. Only to be called by the Timer5 ISR
+	 */
+	void onTick();
+
+private:
+
+	uint8_t mState;			//!< on/off of the actuators, as written by the latest commit
+	uint8_t mActiveLow;		//!< the actuators driven low to activate, see Actuator::mActiveHigh
+
+	const uint8_t * mDemand;					//!< of the latest commit, for the tick
+
+	uint8_t mPwmChannels[CHANNEL_MASK_SZ];		//!< the channels under PWM
+	volatile uint8_t mPwmOut[CHANNEL_MASK_SZ];	//!< their outputs, written by the tick only
+	uint8_t mDutyTicks[CHANNEL_COUNT];			//!< the on part of the window
+	volatile uint8_t mToggles[CHANNEL_COUNT];	//!< see takeActivity
+	volatile uint16_t mOnTicks[CHANNEL_COUNT];	//!< see takeActivity
+	uint8_t mPhase;								//!< tick within the window
+
+	unsigned long mOnSince[ACTUATOR_COUNT];		//!< millis() of the on edge, valid while on
+	unsigned long mOnTime[ACTUATOR_COUNT];		//!< ms, closed on periods since takeOnTime
+	uint16_t mActuatorToggles[ACTUATOR_COUNT];
+};
+
+
+#endif /* ACTUATORBANK_H_ */
@@ -2,29 +2,37 @@
 //    FILE: ad5165_dPot.cpp
 //  AUTHOR: Mikhail Soloviev
 //    DATE: 04-june-2016
-// VERSION: 0.1.00
+// VERSION: 0.1.01
 // PURPOSE: SPI AD5165 library for Arduino
 //     URL: 
 //
 // HISTORY:
+// see AD5165.h file
 // 
 
 #include "ad5165_dPot.h"
 
 #include <SPI.h>
 
-const int CS = 11;
+AD5165::AD5165(uint8_t csPin) : m_cs(csPin), m_value(0)
+{
+}
 
-AD5165::AD5165() : m_value(0)
+void AD5165::begin()
 {
 	// set the CS as an output:
-	pinMode (CS, OUTPUT);
+	pinMode (m_cs, OUTPUT);
 	pinMode(22, INPUT);
 
 	// initialize SPI:
 	SPI.begin();
 	SPI.setBitOrder(MSBFIRST);
 	SPI.setClockDivider(SPI_CLOCK_DIV32);
+
+	// the part powers up at midscale, bring it in line with m_value
+	digitalWrite(m_cs, HIGH);
+	SPI.transfer(m_value);
+	digitalWrite(m_cs, LOW);
 }
 
 void AD5165::resistance(uint8_t value)
@@ -33,11 +41,18 @@ void AD5165::resistance(uint8_t value)
 	{
 		m_value = value;
 
-		digitalWrite(CS, HIGH);
+		digitalWrite(m_cs, HIGH);
 
 		SPI.transfer(value);
 
-		digitalWrite(CS, LOW);
+		digitalWrite(m_cs, LOW);
 	}
 }
 
+uint8_t AD5165::fromOhms(long ohms)
+{
+	long value = (ohms - AD5165_RW) * 256 / AD5165_RAB;
+
+	// never 0, it would leave just the wiper in series with the NTC
+	return value < 1 ? 1 : (value > 255 ? 255 : value);
+}
@@ -2,11 +2,14 @@
 //    FILE: AD5165.H
 //  AUTHOR: Mikhail Soloviev
 //    DATE: 04-june-2016
-// VERSION: 0.1.00
+// VERSION: 0.1.01
 // PURPOSE: SPI AD5165 library for Arduino
 //     URL: 
 //
 // HISTORY:
+// 0.1.01 the CS pin is a parameter, SPI is set up in begin();
+//        added the conversions to and from ohm
+// 0.1.00 initial version
 // 
 
 #ifndef _AD5165_DPOT_H
@@ -14,17 +17,29 @@
 
 #include "Arduino.h"
 
-#define AD5165_LIB_VERSION "0.1.00"
+#define AD5165_LIB_VERSION "0.1.01"
+
+#define AD5165_RAB	100000L		// end to end resistance of the 100K part, ohm
+#define AD5165_RW	100L		// wiper resistance, ohm
 
 class AD5165
 {
 public:
-	AD5165();
+	AD5165(uint8_t csPin = 11);
+
+	void begin();
 
 	void resistance(uint8_t);
 
+	uint8_t value() { return m_value; }
+
+	// RWB = D / 256 * RAB + RW
+	static long toOhms(uint8_t value) { return (long)value * AD5165_RAB / 256 + AD5165_RW; }
+	static uint8_t fromOhms(long ohms);
+
 private:
 
+	uint8_t m_cs;
 	uint8_t m_value;
 };
 
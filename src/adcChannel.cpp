@@ -13,21 +13,27 @@
 #include "Arduino.h"
 #include "adcChannel.h"
 #include "channel.h"
+#include "adcEngine.h"
 
+extern AdcEngine Adc;
 
 
-AdcChannel::AdcChannel() : mAnalogPin(0), lastSampledTime(0), mIsActive(false)
+
+AdcChannel::AdcChannel() : mAnalogPin(0), lastSampledTime(0), mIsActive(false), mState(idle), mStateTime(0),
+						   mAccumulator(0), mSampleCount(0), mReading(SAMPLE_COUNT), mHasReading(false), mIsRamKnots(false),
+						   mFilter(NULL), mFilterType(filter_none), mR0(0), mPot(NULL), mPotValue(0),
+						   mChange(0), mPeriod(maxSamplePeriod), mMinPeriod(minSamplePeriod), mMaxPeriod(maxSamplePeriod)
 {
-	memset( mSampleWindow, 0, sizeof(float) * SAMPLE_WINDOW );
-	mCurrentSampleIndex = 0;
-	mIsSampleWindowFull = false;
+	setSensorType(ntc_mf52_10k);
 }
 
-AdcChannel::AdcChannel(int analogPin) : mAnalogPin(analogPin), lastSampledTime(0), mIsActive(false)
+AdcChannel::AdcChannel(int analogPin) : mAnalogPin(analogPin), lastSampledTime(0), mIsActive(false), mState(idle),
+										 mStateTime(0), mAccumulator(0), mSampleCount(0), mReading(SAMPLE_COUNT), mHasReading(false),
+										 mIsRamKnots(false), mFilter(NULL), mFilterType(filter_none), mR0(0), mPot(NULL), mPotValue(0),
+										 mChange(0), mPeriod(maxSamplePeriod), mMinPeriod(minSamplePeriod),
+										 mMaxPeriod(maxSamplePeriod)
 {
-	memset( mSampleWindow, 0, sizeof(float) * SAMPLE_WINDOW );
-	mCurrentSampleIndex = 0;
-	mIsSampleWindowFull = false;
+	setSensorType(ntc_mf52_10k);
 }
 
 
@@ -46,66 +52,241 @@ bool AdcChannel::isDue()
 
 	// provide for the wrap around of millis()
 
-	return !lastSampledTime || ms < lastSampledTime || (ms - lastSampledTime) >= samplePeriod;
+	return !lastSampledTime || ms < lastSampledTime || (ms - lastSampledTime) >= mPeriod;
 }
 
 
 
-float AdcChannel::getTemperature(float res, int b)
+void AdcChannel::reschedule(int16_t margin)
+{
+	margin = margin < 0 ? 0 : margin;
+
+	// far from the thresholds: slow, right at them: fast. Linear in between
+
+	unsigned long period = mMaxPeriod;
+
+	if( margin < farMargin )
+		period = mMinPeriod + (mMaxPeriod - mMinPeriod) * margin / farMargin;
+
+	// at the current rate the threshold may be reached in margin / mChange
+	// periods. Make sure to look at least twice on the way
+
+	if( mChange > 0 && margin < farMargin )
+	{
+		unsigned long eta = mPeriod * margin / mChange;
+
+		if( eta / 2 < period )
+			period = eta / 2;
+	}
+
+	mPeriod = period < mMinPeriod ? mMinPeriod : period;
+}
+
+
+
+void AdcChannel::setPeriodBounds(unsigned long minPeriod, unsigned long maxPeriod)
+{
+	mMinPeriod = minPeriod;
+	mMaxPeriod = maxPeriod;
+
+	// the next reading comes within the new bounds, not after the old period
+
+	if( mPeriod > mMaxPeriod )
+		mPeriod = mMaxPeriod;
+
+	if( mPeriod < mMinPeriod )
+		mPeriod = mMinPeriod;
+}
+
+
+
+void AdcChannel::startSampling()
 {
 	// discharge the LP filter capacitor, because
 	// the same filter is used for all inputs on the same
 	// shield
 	analogWrite(mAnalogPin, 0);
-	delay(10);
 
-	// set back in high impedance and wait a little
+	// the range of this channel. Settles along with the filter
 
-	pinMode(mAnalogPin, INPUT);
-	analogRead(mAnalogPin);
-	delay(2000);
+	if( mPot )
+		mPot->resistance(mPotValue);
+
+	mState = discharging;
+	mStateTime = millis();
+}
 
-	long accumulator = 0;
 
-	for( int i = 0; i < 5; i++ )
+
+bool AdcChannel::advance()
+{
+	unsigned long ms = millis();
+
+	switch( mState )
 	{
-		int v = analogRead(mAnalogPin);	// voltage;
+	case discharging:
+		if( ms - mStateTime < dischargeTime )
+			break;
 
-		v = v == 0 ? 1 : v;
+		// set back in high impedance and wait a little
 
-		accumulator += v;
-	}
-	long Vout = accumulator / 5;
-	lastSampledTime = millis();
+		pinMode(mAnalogPin, INPUT);
 
-	// calculate thermistor resistance
-	float ratio = (float)1/((float)1023/(float)Vout-(float)1);
-	float Rth = (float)res * ratio;
+		mState = settling;
+		mStateTime = ms;
+		break;
 
-	float temp = 1.0/(1.0/298.15 + 1.0/b*log(Rth/res))-273.15;
+	case settling:
+		if( ms - mStateTime < settleTime )
+			break;
 
-	return temp;
+		// the conversions are done by the ADC engine in the background
 
-	//float temp = B/log(Rth/(R0*exp(-B/298.15)))-273.15;
-	//THERM=100k*exp( 3950/(temp+273) - 3950/(25+273) )
+		mAccumulator = 0;
+		mSampleCount = 0;
+		Adc.enable(mAnalogPin - A0);
+		mState = accumulating;
+		break;
+
+	case accumulating:
+		// take whatever the engine has collected since the last pass
+
+		mSampleCount += Adc.drain(mAnalogPin - A0, &mAccumulator, SAMPLE_COUNT - mSampleCount);
 
-	// the temp is an instantaneous sample, but the getTemperature
-	// returns the value averaged over the last SAMPLE_WINDOW samples
+		if( mSampleCount < SAMPLE_COUNT )
+			break;
 
-	if( mCurrentSampleIndex == SAMPLE_WINDOW )
+		Adc.disable(mAnalogPin - A0);
+
+		lastSampledTime = ms;
+		mState = converting;
+		break;
+
+	case converting:
 	{
-		mIsSampleWindowFull = true;
-		mCurrentSampleIndex =  0;
+		uint16_t previous = mReading;
+
+		mReading = mAccumulator == 0 ? 1 : mAccumulator;
+
+		if( mPot )
+			mReading = autoRange(mReading);
+
+		if( mFilter )
+			mReading = mFilter->update(mReading);
+
+		// the first reading has nothing to compare with, the rate stays 0
+
+		mChange = mHasReading ? abs((int16_t)(mReading - previous)) : 0;
+		mHasReading = true;
+		mState = idle;
+		return true;
+	}
+
+	default:;
 	}
+	return false;
+}
+
+
+
+void AdcChannel::setFilter(uint8_t type)
+{
+	if( type == mFilterType )
+		return;
+
+	delete mFilter;
+	mFilter = createFilter(type);
+	mFilterType = mFilter ? type : filter_none;
+}
+
+
+
+void AdcChannel::setSensorType(uint8_t type)
+{
+	type = type < NTC_TYPE_COUNT ? type : ntc_mf52_10k;
+
+	mKnots = (const int16_t *)pgm_read_ptr( &NtcCurves[type].mKnots );
+	mIsRamKnots = false;
+	mR0 = pgm_read_dword( &NtcCurves[type].mR0 );
+	mPotValue = AD5165::fromOhms(mR0);
+}
+
+
+
+void AdcChannel::setCurve(const int16_t * knots, long r0)
+{
+	mKnots = knots;
+	mIsRamKnots = true;
+	mR0 = r0;
+	mPotValue = AD5165::fromOhms(mR0);
+}
+
+
+
+void AdcChannel::setPot(AD5165 * pot)
+{
+	mPot = pot;
+	mPotValue = AD5165::fromOhms(mR0);
+}
+
+
 
-	mSampleWindow[mCurrentSampleIndex++] = temp;
+// AdcChannel::autoRange ********************************************
+// ******************************************************************
+// normalizes the reading taken with the pot to the divider pulled up by
+// R0 and picks the pot setting for the next reading
+//
+uint16_t AdcChannel::autoRange(uint16_t reading)
+{
+	if( reading >= FULL_SCALE )
+		reading = FULL_SCALE - 1;			// open sensor, avoid division by zero
+
+	// Rth = Rp * r / (FS - r), the normalized reading is FS * Rth / (R0 + Rth),
+	// i.e. FS * Rp * r / (R0 * (FS - r) + Rp * r). Rp * r is below 2^31. R0 is
+	// scaled below 2^17 so that the denominator fits 32 bits, then both sides
+	// below 2^18 so that FS (2^14) times the numerator does. It is off by a
+	// 1/16 LSB at most, for any R0 parseSensor takes
+
+	uint32_t rpr = (uint32_t)AD5165::toOhms(mPotValue) * reading;
+	uint8_t shift = 0;
+
+	while( ((uint32_t)mR0 >> shift) >= (1UL << 17) )
+		shift++;
 
-	float sampleSum = 0;
-	int sampleCnt = mIsSampleWindowFull ? SAMPLE_WINDOW : mCurrentSampleIndex;
+	uint32_t num = rpr >> shift;
+	uint32_t den = ((uint32_t)mR0 >> shift) * (FULL_SCALE - reading) + num;
 
-	for( int i = 0; i < sampleCnt; i++ )
+	while( num >= (1UL << 18) )
 	{
-		sampleSum += mSampleWindow[i];
+		num >>= 1;
+		den >>= 1;
 	}
-	return sampleSum/(float)sampleCnt;
+	uint16_t normalized = den ? FULL_SCALE * num / den : 0;
+
+	// re-range if off the middle half of the scale. This reading is still
+	// good, just with less resolution
+
+	if( reading < FULL_SCALE / 4 || reading > FULL_SCALE * 3 / 4 )
+	{
+		mPotValue = AD5165::fromOhms(rpr / (FULL_SCALE - reading));		// Rth
+	}
+	return normalized;
+}
+
+
+
+float AdcChannel::getTemperature(float res, int b)
+{
+	float Vout = (float)mReading / SAMPLE_COUNT;
+
+	// calculate thermistor resistance
+	float ratio = (float)1/((float)1023/(float)Vout-(float)1);
+	float Rth = (float)res * ratio;
+
+	float temp = 1.0/(1.0/298.15 + 1.0/b*log(Rth/res))-273.15;
+
+	return temp;
+
+	//float temp = B/log(Rth/(R0*exp(-B/298.15)))-273.15;
+	//THERM=100k*exp( 3950/(temp+273) - 3950/(25+273) )
 }
@@ -15,9 +15,12 @@
 #define ADCCHANNEL_H_
 
 #include <Arduino.h>
+#include "ntcTable.h"
+#include "filter.h"
+#include "ad5165_dPot.h"
 
-#define SAMPLE_WINDOW	6		// number of samples to keep in the ring buffer for averaging
-								// Be careful, this affects RAM usage alot.
+#define SAMPLE_COUNT	16		// number of ADC conversions summed into one reading (1/16 LSB)
+#define FULL_SCALE		(SAMPLE_COUNT * 1023L)	// the reading at Vcc
 
 /*! @brief Implements ADC that translates thermistor voltages.
  *
@@ -32,6 +35,22 @@
  */
 class AdcChannel
 {
+public:
+
+	/*! @brief Enumerates the steps of the sampling cycle.
+	 *
+	 * A reading takes a couple of seconds, mostly waiting for the LP filter
+	 * to settle. The cycle is therefore split into steps, the owner calls
+	 * advance() once per loop pass and never waits.
+	 */
+	typedef enum SamplingState {
+		idle,				/*!< not sampling */
+		discharging,		/*!< the LP filter capacitor is shorted to ground */
+		settling,			/*!< back in high impedance, waiting for the filter to charge */
+		accumulating,		/*!< collecting the conversions from the ADC engine */
+		converting			/*!< the reading is complete, to be filtered */
+	} SamplingState_t;
+
 public:
 	AdcChannel();
 	AdcChannel(int analogPin);
@@ -44,15 +63,88 @@ public:
 	 * just an option. There are good reasons why the aggregator of this class
 	 * should decide when to sample. But for now it is left as it is.
 	 *
-	 * @see samplePeriod
+	 * The period is adapted after every reading, see reschedule.
 	 *
-	 * @return     Based on the samplePeriod true or false
+	 * @return     Based on the current period true or false
 	 */
 	bool isDue();
 
+	/*!
+	 * @brief      Adapts the sampling period after a reading.
+	 *
+	 * The closer the temperature is to a switching threshold, the more often the
+	 * channel is sampled. A channel moving towards the threshold is sampled at
+	 * least twice before it could reach it at the current rate of change. The
+	 * period is kept within the bounds set by setPeriodBounds.
+	 *
+	 * @param[in]  margin distance of the reading to the nearest threshold (in
+	 *             readings), 0x7FFF if the channel controls nothing
+	 */
+	void reschedule(int16_t margin);
+
+	/*!
+	 * @brief      Sets the limits of the adaptive sampling period.
+	 * @param[in]  minPeriod the period used right at a threshold (ms)
+	 * @param[in]  maxPeriod the period used far from the thresholds (ms)
+	 */
+	void setPeriodBounds(unsigned long minPeriod, unsigned long maxPeriod);
+
+	unsigned long getPeriod() { return mPeriod; }		//!< The current sampling period (ms)
+	unsigned long getMinPeriod() { return mMinPeriod; }
+	unsigned long getMaxPeriod() { return mMaxPeriod; }
+
+	/*!
+	 * @brief      Starts a new sampling cycle.
+	 *
+	 * Only starts the discharge of the LP filter, the rest is done by advance().
+	 * The LP filter is shared by all the inputs of the shield, so the owner
+	 * shall not start a channel while another one is sampling.
+	 */
+	void startSampling();
+
+	/*!
+	 * @brief      Advances the sampling cycle by one step, if the step is done.
+	 *
+	 * Shall be called once per loop pass while isSampling(). Never blocks.
+	 *
+	 * @return     true when the reading is complete and getReading may be called
+	 */
+	bool advance();
+
+	/*!
+	 * @brief      Checks if the sampling cycle is in progress.
+	 * @return     true from startSampling until the reading is converted
+	 */
+	bool isSampling() { return mState != idle; }
+
+
+	/*!
+	 * @brief      The latest reading, filtered.
+	 *
+	 * The reading is not converted to temperature. The control path compares it
+	 * with the thresholds turned into readings, see ntcReadingAtOrBelow. Only
+	 * the display and the logger need the temperature, they call convert.
+	 *
+	 * @return     The sum of SAMPLE_COUNT conversions, i.e. the ADC code in 1/16 LSB
+	 */
+	uint16_t getReading() { return mReading; }
+
+	/*!
+	 * @brief      Converts a reading to temperature with the table of the sensor.
+	 * @return     Temperature in one hundredth of centigrade
+	 */
+	int16_t convert(uint16_t reading) { return ntcLookup(mKnots, reading, mIsRamKnots); }
+
+	/*!
+	 * @brief      The inverse of convert, see ntcReadingAtOrBelow
+	 */
+	uint16_t readingAtOrBelow(int16_t t) { return ntcReadingAtOrBelow(mKnots, t, mIsRamKnots); }
 
 	/*!
-	 * @brief      Reads ADC and converts to temperature.
+	 * @brief      Converts the latest reading to temperature the slow way.
+	 *
+	 * The sampling cycle uses the lookup table of the sensor. This function is
+	 * only kept for checking the accuracy of the tables.
 	 *
 	 * The following formula is implemented:
 	 * float temp = 1.0/(1.0/298.15 + 1.0/B*log(Rth/R0))-273.15;
@@ -71,6 +163,7 @@ public:
 	 * The ADC objects are created inactive. They will not sample until activated
 	 */
 	void activate();
+	void deactivate() { mIsActive = false; mHasReading = false; }	//!< stops sampling, the configuration dropped it
 
 	/*!
 	 * @brief      Checks if the ADC is active (sampling).
@@ -78,25 +171,117 @@ public:
 	 */
 	bool isActive() { return mIsActive; }
 
+	/*!
+	 * @brief      Selects the lookup table the readings are converted with.
+	 * @param[in]  type one of the NtcType_t
+	 */
+	void setSensorType(uint8_t type);
+
+	/*!
+	 * @brief      Selects a lookup table built in RAM, see ntcBuildTable.
+	 *
+	 * The table is not owned, it shall live as long as the channel uses it.
+	 *
+	 * @param[in]  knots NTC_KNOT_COUNT temperatures
+	 * @param[in]  r0    the resistance the table is calculated for
+	 */
+	void setCurve(const int16_t * knots, long r0);
+
+	/*!
+	 * @brief      Selects the filter the readings go through before the conversion.
+	 *
+	 * The filter works on the readings, not on the temperature. The previous filter
+	 * of the channel, if any, is released. The same type keeps the filter and
+	 * its history. Only to be used when the configuration is loaded.
+	 *
+	 * @param[in]  type one of the FilterType_t
+	 */
+	void setFilter(uint8_t type);
+
+	/*!
+	 * @brief      Puts the channel in the auto-ranging mode.
+	 *
+	 * The NTC is pulled up by the AD5165 instead of a fixed resistor. After every
+	 * reading that is far from mid-scale, the pot is set to match the NTC's
+	 * current resistance for the next one. That is where the divider has the
+	 * best resolution. The setting is remembered per channel and written to the
+	 * pot when the channel starts sampling. AD5165::resistance skips the write
+	 * if the pot already has it.
+	 *
+	 * The readings are normalized to the divider pulled up by R0 of the sensor,
+	 * so the lookup tables and the threshold readings stay valid whatever the
+	 * range is.
+	 *
+	 * Each ADC pin needs its own pot, the channels of one pin are never sampled
+	 * at the same time.
+	 *
+	 * @param[in]  pot the pot in series with the NTC, NULL for a fixed resistor
+	 */
+	void setPot(AD5165 * pot);
+
 private:	// note: no doxygen documentation is generated by default for private members
 
+	uint16_t autoRange(uint16_t reading);
+
 	int mAnalogPin;						//!< One of the A0, A1, etc.
 
 	unsigned long lastSampledTime;		//!< Milliseconds when getTemperature requested latest
 
 	bool mIsActive;
 
-	float mSampleWindow[SAMPLE_WINDOW];	//!< A sliding window used as a SW filter. The last 6 samples
+	SamplingState_t mState;				//!< Current step of the sampling cycle
+
+	unsigned long mStateTime;			//!< Milliseconds when the current step started
 
-	byte mCurrentSampleIndex;			//!< A ring buffer pointer for mTempWindow
+	long mAccumulator;					//!< Sum of the conversions drained in the accumulating step
 
-	bool mIsSampleWindowFull;			//!< Indicator of whether the SAMPLE_WINDOW is filled
+	byte mSampleCount;					//!< Number of conversions in mAccumulator
+
+	uint16_t mReading;					//!< The latest reading, the sum of SAMPLE_COUNT conversions
+	bool mHasReading;					//!< mReading is a reading, not the placeholder. mChange needs two
+
+	const int16_t * mKnots;				//!< The lookup table of the sensor
+
+	bool mIsRamKnots;					//!< mKnots is in RAM, not in PROGMEM
+
+	SampleFilter * mFilter;				//!< NULL if the readings are not filtered
+
+	uint8_t mFilterType;				//!< one of the FilterType_t
+
+	long mR0;							//!< R0 of the sensor, the readings are normalized to it
+
+	AD5165 * mPot;						//!< NULL if pulled up by a fixed resistor
+
+	uint8_t mPotValue;					//!< the pot setting of this channel, should match the NTC
+
+	int16_t mChange;					//!< Reading change over the latest period, absolute value
+
+	unsigned long mPeriod;				//!< The current sampling period (ms)
+
+	unsigned long mMinPeriod;
+
+	unsigned long mMaxPeriod;
 
 public:
 	/*!
-	 * @brief How often (period in ms) the sampling is supposed to occur
+	 * @brief Default bounds of the sampling period (ms)
 	 */
-	static const unsigned long samplePeriod = 20000;
+	static const unsigned long minSamplePeriod = 5000;
+
+	static const unsigned long maxSamplePeriod = 60000;
+
+	/*!
+	 * @brief Margin at which the channel is considered far from its thresholds
+	 * and is sampled at the max period (in readings).
+	 *
+	 * A 10K NTC pulled up by 10K gives some 160 readings per centigrade at the
+	 * room temperature, so this is about 3C
+	 */
+	static const int16_t farMargin = 480;
+
+	static const unsigned long dischargeTime = 10;		//!< How long the LP filter is shorted (ms)
+
+	static const unsigned long settleTime = 2000;		//!< How long the LP filter settles after discharge (ms)
 
 
 	/*!
@@ -0,0 +1,162 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Implementation of the interrupt driven ADC engine
+ *
+ * Created on: 		2016-09-12
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+#include "Arduino.h"
+#include "adcEngine.h"
+
+extern AdcEngine Adc;
+
+
+ISR(ADC_vect)
+{
+	Adc.onConversion();
+}
+
+
+
+AdcEngine::AdcEngine() : mScanMask(0), mIsRunning(false), mResultChannel(0), mMuxChannel(0), mSkip(0), mOverruns(0)
+{
+	memset( (void *)mHead, 0, sizeof(mHead) );
+	memset( mTail, 0, sizeof(mTail) );
+}
+
+
+
+void AdcEngine::begin()
+{
+	// AVcc reference, ADC0. Free running trigger source, MUX5 cleared (ADC0...ADC7 only)
+
+	ADMUX = _BV(REFS0);
+	ADCSRB = 0;
+
+	// enabled, interrupt enabled, prescaler 128: 125kHz ADC clock at 16MHz,
+	// a conversion every 104us
+
+	ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+}
+
+
+
+void AdcEngine::select(uint8_t channel)
+{
+	ADMUX = _BV(REFS0) | (channel & 0x07);
+	mMuxChannel = channel;
+}
+
+
+
+void AdcEngine::enable(uint8_t channel)
+{
+	uint8_t oldSREG = SREG;
+	cli();
+
+	mTail[channel] = mHead[channel];
+	mScanMask |= 1 << channel;
+
+	if( !mIsRunning )
+	{
+		select(channel);
+		mResultChannel = channel;
+		mSkip = 1;				// the S/H capacitor still holds the previous channel
+		mIsRunning = true;
+
+		ADCSRA |= _BV(ADATE) | _BV(ADSC);
+	}
+
+	SREG = oldSREG;
+}
+
+
+
+void AdcEngine::disable(uint8_t channel)
+{
+	// the ISR stops the ADC when it finds the scan mask empty
+
+	mScanMask &= ~(1 << channel);
+}
+
+
+
+uint8_t AdcEngine::drain(uint8_t channel, long * sum, uint8_t max)
+{
+	uint8_t count = 0;
+	uint8_t tail = mTail[channel];
+
+	while( count < max && tail != mHead[channel] )
+	{
+		*sum += mRing[channel][tail];
+		tail = (tail + 1) & (ADC_RING_SIZE - 1);
+		count++;
+	}
+
+	mTail[channel] = tail;
+	return count;
+}
+
+
+
+// AdcEngine::onConversion ******************************************
+// ******************************************************************
+// runs in the interrupt context. Keep it short
+//
+void AdcEngine::onConversion()
+{
+	uint16_t v = ADC;
+	uint8_t ch = mResultChannel;
+
+	// the conversion running now was started with the current ADMUX
+
+	mResultChannel = mMuxChannel;
+
+	if( mSkip )
+	{
+		mSkip--;
+	}
+	else if( mScanMask & (1 << ch) )
+	{
+		uint8_t head = mHead[ch];
+		uint8_t next = (head + 1) & (ADC_RING_SIZE - 1);
+
+		if( next != mTail[ch] )
+		{
+			mRing[ch][head] = v;
+			mHead[ch] = next;
+		}
+		else
+		{
+			mOverruns++;
+		}
+	}
+
+	if( !mScanMask )
+	{
+		// nothing to scan. Let the conversion in progress run out and stop
+
+		ADCSRA &= ~_BV(ADATE);
+		mIsRunning = false;
+		return;
+	}
+
+	// step to the next enabled channel, it will be converted after the
+	// one running now
+
+	uint8_t next = mMuxChannel;
+
+	do {
+		next = (next + 1) & (ADC_ENGINE_CHANNELS - 1);
+	} while( !(mScanMask & (1 << next)) );
+
+	if( next != mMuxChannel )
+	{
+		select(next);
+	}
+}
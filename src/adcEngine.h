@@ -0,0 +1,117 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Interrupt driven ADC engine
+ *
+ * Created on: 		2016-09-12
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef ADCENGINE_H_
+#define ADCENGINE_H_
+
+#include <Arduino.h>
+
+#define ADC_ENGINE_CHANNELS	8		// ADC0...ADC7, i.e. the pins A0...A7
+#define ADC_RING_SIZE		32		// samples per channel, must be a power of two. Holds one less
+#define ADC_CONVERSION_US	104		// 13 ADC clocks at 16MHz / 128, see begin
+
+/*! @brief Runs the ADC in the background.
+ *
+ * The ADC is put in the free running mode with the conversion complete
+ * interrupt (ADC_vect) enabled. The ISR steps through the enabled channels by
+ * itself and drops each result in the ring buffer of its channel. The owner
+ * drains the ring buffers from loop() whenever it suits, so the CPU never
+ * spins waiting for a conversion the way analogRead does.
+ *
+ * Each ring buffer has a single producer (the ISR) and a single consumer
+ * (loop), and the indices are single bytes. So no locking is needed.
+ *
+ * Once the engine is begun, analogRead shall not be used anymore. It would
+ * fight with the ISR over the multiplexer.
+ */
+class AdcEngine
+{
+public:
+	AdcEngine();
+	virtual ~AdcEngine() {};
+
+	/*!
+	 * @brief      Configures the ADC. Has to be called in the setup by the owner
+	 */
+	void begin();
+
+	/*!
+	 * @brief      Adds a channel to the scan. Starts the ADC if it was stopped
+	 *
+	 * The ring buffer of the channel is emptied, so that all the samples
+	 * drained after this call are taken after it.
+	 *
+	 * @param[in]  channel ADC channel 0...7 (pin - A0)
+	 */
+	void enable(uint8_t channel);
+
+	/*!
+	 * @brief      Removes a channel from the scan. The ADC stops with the last one
+	 *
+	 * @param[in]  channel ADC channel 0...7 (pin - A0)
+	 */
+	void disable(uint8_t channel);
+
+	/*!
+	 * @brief      Pops the samples collected for the channel
+	 *
+	 * @param[in]  channel ADC channel 0...7 (pin - A0)
+	 * @param[out] sum     the popped samples are added to it
+	 * @param[in]  max     pops no more than this many samples
+	 *
+	 * @return     The number of popped samples
+	 */
+	uint8_t drain(uint8_t channel, long * sum, uint8_t max);
+
+	/*!
+	 * @brief      Number of samples lost because the owner did not drain in time
+	 */
+	unsigned int getOverruns() { return mOverruns; }
+
+	/*!
+	 * @brief      The conversion complete handler. Only to be called from ADC_vect
+	 */
+	void onConversion();
+
+private:
+
+	void select(uint8_t channel);
+
+	volatile uint8_t mScanMask;			//!< bit 0 - ADC0, bit 7 - ADC7
+
+	volatile bool mIsRunning;
+
+	/*!
+	 * @brief The channel of the conversion that completes next.
+	 *
+	 * In free running mode the next conversion is already started when the
+	 * ISR runs, so a new multiplexer setting only takes effect one conversion
+	 * later. The engine keeps track of which result belongs to which channel.
+	 */
+	volatile uint8_t mResultChannel;
+
+	volatile uint8_t mMuxChannel;		//!< The channel currently set in ADMUX
+
+	volatile uint8_t mSkip;				//!< Results to throw away after (re)start
+
+	volatile uint16_t mRing[ADC_ENGINE_CHANNELS][ADC_RING_SIZE];	//!< 512 bytes, see AdcRingSizeCheck
+
+	volatile uint8_t mHead[ADC_ENGINE_CHANNELS];	//!< written by the ISR only
+
+	uint8_t mTail[ADC_ENGINE_CHANNELS];				//!< written by the owner only
+
+	volatile unsigned int mOverruns;
+};
+
+
+#endif /* ADCENGINE_H_ */
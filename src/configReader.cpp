@@ -0,0 +1,209 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Configuration file reader
+ *
+ * Created on: 		2016-10-24
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#include "configReader.h"
+
+// the texts stay in flash, they are only printed on an error
+
+static const char textOk[] PROGMEM = "ok";
+static const char textRead[] PROGMEM = "cannot read the file";
+static const char textTooLong[] PROGMEM = "line too long";
+static const char textTooMany[] PROGMEM = "too many words";
+static const char textChannel[] PROGMEM = "channel missing or out of range";
+static const char textCalibration[] PROGMEM = "calibration C+<v> or C-<v> expected";
+static const char textMode[] PROGMEM = "unknown control mode (HYS, TP, PID)";
+static const char textLogging[] PROGMEM = "logging switch L:ON or L:OFF expected";
+static const char textLimits[] PROGMEM = "low limit higher than high limit";
+static const char textNumber[] PROGMEM = "number expected";
+static const char textActuator[] PROGMEM = "actuator out of range";
+static const char textCombine[] PROGMEM = "OR, AND or MAJ expected";
+static const char textPriority[] PROGMEM = "priority channel out of range";
+static const char textRule[] PROGMEM = "malformed rule";
+static const char textRulesFull[] PROGMEM = "rules too long";
+static const char textUnexpected[] PROGMEM = "unexpected word";
+static const char textSensor[] PROGMEM = "unknown sensor S:MF52, S:B57861, S:MF58, S:<R0>/<B> or S:<R>/<A>/<B>/<C>";
+static const char textSensorsFull[] PROGMEM = "too many sensors given by parameters";
+static const char textPeriod[] PROGMEM = "sample period P:<s> or P:<min>-<max> expected";
+static const char textFilter[] PROGMEM = "unknown filter (NONE, AVG4, AVG8, EMA, MED3, MED5)";
+
+static const char * const statusTexts[CONFIG_STATUS_COUNT] PROGMEM = {
+	textOk,
+	textRead,
+	textTooLong,
+	textTooMany,
+	textChannel,
+	textCalibration,
+	textMode,
+	textLogging,
+	textLimits,
+	textNumber,
+	textActuator,
+	textCombine,
+	textPriority,
+	textRule,
+	textRulesFull,
+	textUnexpected,
+	textSensor,
+	textSensorsFull,
+	textPeriod,
+	textFilter
+};
+
+
+// configStatusText *************************************************
+// ******************************************************************
+//
+const __FlashStringHelper * configStatusText(ConfigStatus_t status)
+{
+	if( status >= CONFIG_STATUS_COUNT )
+		return F("?");
+
+	return (const __FlashStringHelper *)pgm_read_ptr( &statusTexts[status] );
+}
+
+
+// ConfigLine::toInt ************************************************
+// ******************************************************************
+//
+bool ConfigLine::toInt(const char * s, int * value)
+{
+	if( !s )
+		return false;
+
+	const char * p = s;
+
+	if( *p == '+' || *p == '-' )
+		p++;
+
+	if( !isdigit(*p) )
+		return false;
+
+	long v = 0;
+
+	while( isdigit(*p) )
+	{
+		v = v * 10 + (*p++ - '0');
+
+		if( v > 32767 )
+			return false;
+	}
+
+	if( *p )
+		return false;
+
+	*value = s[0] == '-' ? -v : v;
+	return true;
+}
+
+
+ConfigReader::ConfigReader(File & file) : mFile(file)
+{
+	mPos = 0;
+	mLen = 0;
+	mIsEof = false;
+	mLineNumber = 0;
+	mStatus = config_ok;
+}
+
+
+// ConfigReader::next ***********************************************
+// ******************************************************************
+// the line is taken from the buffer if its end is there. Otherwise
+// its start is moved to the front and the buffer is filled up
+//
+bool ConfigReader::next(ConfigLine * line)
+{
+	if( mStatus != config_ok )
+		return false;
+
+	for( ;; )
+	{
+		char * start = mBuf + mPos;
+		char * nl = (char *)memchr( start, '\n', mLen - mPos );
+
+		if( nl || (mIsEof && mPos < mLen) )
+		{
+			char * end = nl ? nl : mBuf + mLen;
+
+			mPos = end - mBuf + (nl ? 1 : 0);
+			mLineNumber++;
+			split( start, end, line );
+			return true;
+		}
+
+		if( mIsEof )
+			return false;
+
+		if( mPos == 0 && mLen == CONFIG_BLOCK_SZ )
+		{
+			mLineNumber++;
+			mStatus = config_too_long;
+			return false;
+		}
+
+		mLen -= mPos;
+		memmove( mBuf, start, mLen );
+		mPos = 0;
+
+		int n = mFile.read( mBuf + mLen, CONFIG_BLOCK_SZ - mLen );
+
+		if( n < 0 )
+		{
+			mStatus = config_read;
+			return false;
+		}
+
+		if( n == 0 )
+			mIsEof = true;
+
+		mLen += n;
+	}
+}
+
+
+// ConfigReader::split **********************************************
+// ******************************************************************
+// the blanks become the ends of the words
+//
+void ConfigReader::split(char * start, char * end, ConfigLine * line)
+{
+	char * p = start;
+
+	*end = 0;
+	line->mCount = 0;
+	line->mIsTruncated = false;
+
+	while( p < end )
+	{
+		while( p < end && (*p == ' ' || *p == '\t' || *p == '\r') )
+			*p++ = 0;
+
+		if( p >= end )
+			break;
+
+		if( line->mCount == CONFIG_MAX_TOKENS )
+		{
+			line->mIsTruncated = true;
+			break;
+		}
+
+		line->mTokens[line->mCount] = p;
+		line->mColumns[line->mCount] = p - start + 1;
+		line->mCount++;
+
+		while( p < end && *p != ' ' && *p != '\t' && *p != '\r' )
+			p++;
+	}
+
+	line->mEnd = end - start + 1;
+}
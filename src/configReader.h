@@ -0,0 +1,136 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Configuration file reader
+ *
+ * Created on: 		2016-10-24
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef CONFIGREADER_H_
+#define CONFIGREADER_H_
+
+#include <Arduino.h>
+#include <SD.h>
+
+#define CONFIG_BLOCK_SZ		512		// bytes read at once, also the longest line
+#define CONFIG_MAX_TOKENS	24		// per line, the rest of a longer line is not looked at
+
+/*! @brief What is wrong with the configuration */
+typedef enum ConfigStatus {
+	config_ok,
+	config_read,			/*!< the file could not be read */
+	config_too_long,		/*!< the line does not fit in CONFIG_BLOCK_SZ */
+	config_too_many,		/*!< more than CONFIG_MAX_TOKENS words */
+	config_channel,			/*!< channel missing or out of range */
+	config_calibration,		/*!< C+<v> or C-<v> missing or malformed */
+	config_mode,			/*!< unknown M: */
+	config_logging,			/*!< L:ON or L:OFF missing */
+	config_limits,			/*!< the low limit is higher than the high one */
+	config_number,			/*!< a number expected */
+	config_actuator,		/*!< actuator out of range */
+	config_combine,			/*!< OR, AND or MAJ expected */
+	config_priority,		/*!< priority channel out of range */
+	config_rule,			/*!< malformed rule */
+	config_rules_full,		/*!< the rules exceed RULE_CODE_SIZE */
+	config_unexpected,		/*!< a word that does not belong there */
+	config_sensor,			/*!< unknown or malformed S: */
+	config_sensors_full,	/*!< more than NTC_CUSTOM_COUNT sensors given by their parameters */
+	config_period,			/*!< malformed P: */
+	config_filter,			/*!< unknown F: */
+	CONFIG_STATUS_COUNT
+} ConfigStatus_t;
+
+/*! @brief Where the configuration went wrong */
+struct ConfigError
+{
+	ConfigStatus_t mStatus;
+	uint16_t mLine;				//!< from 1
+	uint16_t mColumn;			//!< from 1
+};
+
+/*!
+ * @brief      A few words on the status, for the debugging channel. In flash, print it as it is
+ */
+const __FlashStringHelper * configStatusText(ConfigStatus_t status);
+
+
+/*! @brief One line of the configuration, split into words.
+ *
+ * The words point into the block buffer of the reader, they are only valid
+ * until the next line is read.
+ */
+class ConfigLine
+{
+public:
+	ConfigLine() { mCount = 0; mEnd = 1; mIsTruncated = false; }
+
+	uint8_t getCount() const { return mCount; }
+
+	const char * token(uint8_t i) const { return i < mCount ? mTokens[i] : NULL; }		//!< NULL past the last one
+
+	uint16_t column(uint8_t i) const { return i < mCount ? mColumns[i] : mEnd; }		//!< the end of the line past the last one
+
+	bool is(uint8_t i, const char * word) const { return i < mCount && !strcmp(mTokens[i], word); }
+
+	bool isTruncated() const { return mIsTruncated; }	//!< there were more than CONFIG_MAX_TOKENS
+
+	/*!
+	 * @brief      Parses a whole word as a decimal number, + or - allowed
+	 * @return     false if it is not one
+	 */
+	static bool toInt(const char * s, int * value);
+
+private:
+	friend class ConfigReader;
+
+	const char * mTokens[CONFIG_MAX_TOKENS];
+	uint16_t mColumns[CONFIG_MAX_TOKENS];
+	uint8_t mCount;
+	uint16_t mEnd;
+	bool mIsTruncated;
+};
+
+
+/*! @brief Reads the configuration file a line at a time.
+ *
+ * The file is read in blocks of up to CONFIG_BLOCK_SZ into one buffer. A line
+ * is split where it is: the blanks after the words are overwritten with 0 and
+ * the line keeps pointers to the words. Only the start of a line that goes on
+ * in the next block is moved to the front of the buffer before the read. So
+ * the stack and the time per line stay the same however long the file is.
+ */
+class ConfigReader
+{
+public:
+	ConfigReader(File & file);
+	virtual ~ConfigReader() {};
+
+	/*!
+	 * @brief      Reads and splits the next line
+	 * @return     false at the end of the file or on an error, see getStatus
+	 */
+	bool next(ConfigLine * line);
+
+	ConfigStatus_t getStatus() { return mStatus; }
+	uint16_t getLineNumber() { return mLineNumber; }	//!< of the latest line, from 1
+
+private:
+
+	void split(char * start, char * end, ConfigLine * line);
+
+	File & mFile;
+	char mBuf[CONFIG_BLOCK_SZ + 1];		//!< one more for the end of the last line
+	uint16_t mPos;			//!< the start of the next line
+	uint16_t mLen;			//!< bytes in mBuf
+	bool mIsEof;
+	uint16_t mLineNumber;
+	ConfigStatus_t mStatus;
+};
+
+
+#endif /* CONFIGREADER_H_ */
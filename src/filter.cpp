@@ -0,0 +1,28 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Streaming filters for the ADC readings
+ *
+ * Created on: 		2016-09-27
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+#include "Arduino.h"
+#include "filter.h"
+
+
+SampleFilter * createFilter(uint8_t type)
+{
+	switch( type )
+	{
+	case filter_average4:	return new MovingAverage<4>();
+	case filter_average8:	return new MovingAverage<8>();
+	case filter_ema:		return new ExpMovingAverage<2>();
+	case filter_median3:	return new MedianFilter<3>();
+	case filter_median5:	return new MedianFilter<5>();
+	default:				return NULL;
+	}
+}
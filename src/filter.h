@@ -0,0 +1,189 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Streaming filters for the ADC readings
+ *
+ * Created on: 		2016-09-27
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <Arduino.h>
+
+/*! @brief Enumerates the filters a channel may be configured with. */
+typedef enum FilterType {
+	filter_none,			/*!< the readings are used as they are */
+	filter_average4,		/*!< moving average of the last 4 readings */
+	filter_average8,		/*!< moving average of the last 8 readings */
+	filter_ema,				/*!< exponential moving average, alpha = 1/4 */
+	filter_median3,			/*!< median of the last 3 readings, rejects single outliers */
+	filter_median5,			/*!< median of the last 5 readings, rejects double outliers */
+	FILTER_TYPE_COUNT
+} FilterType_t;
+
+
+/*! @brief The interface of the streaming filters.
+ *
+ * A filter takes one sample at a time and returns the filtered value. The cost
+ * of update does not depend on the window size. The samples are stored as
+ * int16_t, the way the ADC readings come.
+ */
+class SampleFilter
+{
+public:
+	virtual ~SampleFilter() {};
+
+	/*!
+	 * @brief      Folds in a new sample
+	 * @return     The filtered value
+	 */
+	virtual int16_t update(int16_t sample) = 0;
+
+	/*!
+	 * @brief      Forgets the history. The next sample passes through as is
+	 */
+	virtual void reset() = 0;
+};
+
+
+/*! @brief Moving average over N samples.
+ *
+ * Keeps the running sum, so an update is one addition and one subtraction
+ * whatever N is. Until the window is full the average is over the samples
+ * seen so far.
+ */
+template<uint8_t N>
+class MovingAverage : public SampleFilter
+{
+public:
+	MovingAverage() { reset(); }
+
+	virtual int16_t update(int16_t sample)
+	{
+		if( mCount < N )
+			mCount++;
+		else
+			mSum -= mWindow[mIndex];
+
+		mWindow[mIndex] = sample;
+		mSum += sample;
+		mIndex = mIndex + 1 == N ? 0 : mIndex + 1;
+
+		return mSum / mCount;
+	}
+
+	virtual void reset() { mSum = 0; mIndex = 0; mCount = 0; }
+
+private:
+	int16_t mWindow[N];
+	long mSum;
+	uint8_t mIndex;			//!< the oldest sample, overwritten next
+	uint8_t mCount;
+};
+
+
+/*! @brief Exponential moving average with alpha = 1 / 2^SHIFT.
+ *
+ * Only the scaled state is stored. Five bytes of history per channel whatever
+ * the time constant is, the long and the flag of the first sample.
+ */
+template<uint8_t SHIFT>
+class ExpMovingAverage : public SampleFilter
+{
+public:
+	ExpMovingAverage() { reset(); }
+
+	virtual int16_t update(int16_t sample)
+	{
+		if( mIsEmpty )
+		{
+			mState = (long)sample << SHIFT;
+			mIsEmpty = false;
+		}
+		else
+		{
+			mState += sample - (mState >> SHIFT);
+		}
+		return mState >> SHIFT;
+	}
+
+	virtual void reset() { mState = 0; mIsEmpty = true; }
+
+private:
+	long mState;			//!< the average scaled by 2^SHIFT
+	bool mIsEmpty;
+};
+
+
+/*! @brief Median of the last N samples, N odd and small (3, 5, 7).
+ *
+ * A single spike shorter than N/2 + 1 samples never makes it to the output.
+ * The window is kept sorted alongside the ring of the samples. An update
+ * takes the oldest sample out and inserts the new one, a single pass over
+ * the N samples each.
+ */
+template<uint8_t N>
+class MedianFilter : public SampleFilter
+{
+public:
+	MedianFilter() { reset(); }
+
+	virtual int16_t update(int16_t sample)
+	{
+		uint8_t k = mCount;
+
+		if( mCount == N )
+		{
+			// the oldest one goes, the ones above it move down
+
+			for( k = 0; mSorted[k] != mWindow[mIndex]; k++ )
+				;
+			for( ; k + 1 < N; k++ )
+				mSorted[k] = mSorted[k + 1];
+		}
+		else
+		{
+			mCount++;
+		}
+
+		// k is the free slot at the end, the larger ones move up
+
+		for( ; k > 0 && mSorted[k - 1] > sample; k-- )
+			mSorted[k] = mSorted[k - 1];
+
+		mSorted[k] = sample;
+
+		mWindow[mIndex] = sample;
+		mIndex = mIndex + 1 == N ? 0 : mIndex + 1;
+
+		return mSorted[mCount / 2];
+	}
+
+	virtual void reset() { mIndex = 0; mCount = 0; }
+
+private:
+	int16_t mWindow[N];		//!< the samples in the order they came
+	int16_t mSorted[N];		//!< the same, sorted. mCount of them
+	uint8_t mIndex;			//!< the oldest sample, overwritten next
+	uint8_t mCount;
+};
+
+
+/*!
+ * @brief      Creates the filter of the given type
+ *
+ * Only to be used when the configuration is loaded. The filter is allocated on
+ * the heap, so RAM is only spent on the filters that are configured.
+ *
+ * @return     The filter or NULL for filter_none
+ */
+SampleFilter * createFilter(uint8_t type);
+
+
+#endif /* FILTER_H_ */
@@ -0,0 +1,267 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Checkpoint journal class
+ *
+ * Created on: 		2016-10-23
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#include <util/crc16.h>
+#include "journal.h"
+
+
+// crcOf ************************************************************
+// ******************************************************************
+//
+static uint16_t crcOf(uint16_t crc, const uint8_t * p, uint16_t len)
+{
+	while( len-- )
+		crc = _crc16_update(crc, *p++);
+	return crc;
+}
+
+
+Journal::Journal()
+{
+	mIsOpen = false;
+	mSlot = 0;
+	mLatest = 1;
+	mSequence = 0;
+	mLength = 0;
+	mBodyLength = 0;
+	mCrc = 0xFFFF;
+}
+
+
+// Journal::begin ***************************************************
+// ******************************************************************
+// the file gets its full size once, the slots never move
+//
+bool Journal::begin()
+{
+	mFile = SD.open( JOURNAL_FILE, O_READ | O_WRITE | O_CREAT );
+
+	if( !mFile )
+	{
+		Serial1.println( "error opening " JOURNAL_FILE );
+		return false;
+	}
+	mIsOpen = true;
+
+	if( mFile.size() < 2UL * JOURNAL_SLOT_SZ )
+	{
+		uint8_t zeros[32];
+		memset( zeros, 0, sizeof(zeros) );
+
+		if( !mFile.seek( mFile.size() ) )
+		{
+			fail();
+			return false;
+		}
+
+		for( uint32_t n = mFile.size(); n < 2UL * JOURNAL_SLOT_SZ; n += sizeof(zeros) )
+		{
+			if( mFile.write( zeros, sizeof(zeros) ) != sizeof(zeros) )
+			{
+				fail();
+				return false;
+			}
+		}
+		mFile.flush();
+	}
+	return true;
+}
+
+
+// Journal::start ***************************************************
+// ******************************************************************
+//
+bool Journal::start()
+{
+	if( !mIsOpen )
+		return false;
+
+	mSlot = mLatest ^ 1;
+	mLength = 0;
+	mCrc = 0xFFFF;
+
+	if( !mFile.seek( (uint32_t)mSlot * JOURNAL_SLOT_SZ + sizeof(JournalHeader) ) )
+	{
+		fail();
+		return false;
+	}
+	return true;
+}
+
+
+// Journal::add *****************************************************
+// ******************************************************************
+//
+bool Journal::add(const void * data, uint16_t len)
+{
+	if( !mIsOpen )
+		return false;
+
+	if( mLength + len > JOURNAL_SLOT_SZ - sizeof(JournalHeader) )
+	{
+		Serial1.println( "Checkpoint exceeds the journal slot" );
+		return false;
+	}
+
+	if( mFile.write( (const uint8_t *)data, len ) != len )
+	{
+		fail();
+		return false;
+	}
+
+	mCrc = crcOf( mCrc, (const uint8_t *)data, len );
+	mLength += len;
+	return true;
+}
+
+
+// Journal::sync ***************************************************
+// ******************************************************************
+// an SD operation of its own, commit then only writes the header
+//
+bool Journal::sync()
+{
+	if( !mIsOpen )
+		return false;
+
+	mFile.flush();
+	return true;
+}
+
+
+// Journal::commit **************************************************
+// ******************************************************************
+// the body is on the card before the header that vouches for it
+//
+bool Journal::commit()
+{
+	if( !mIsOpen )
+		return false;
+
+	mFile.flush();
+
+	JournalHeader h;
+	h.mMagic = JOURNAL_MAGIC;
+	h.mLength = mLength;
+	h.mSequence = mSequence + 1;
+	h.mCrc = mCrc;
+	h.mHeaderCrc = crcOf( 0xFFFF, (const uint8_t *)&h, sizeof(h) - sizeof(h.mHeaderCrc) );
+
+	if( !mFile.seek( (uint32_t)mSlot * JOURNAL_SLOT_SZ ) || mFile.write( (const uint8_t *)&h, sizeof(h) ) != sizeof(h) )
+	{
+		fail();
+		return false;
+	}
+	mFile.flush();
+
+	mSequence = h.mSequence;
+	mLatest = mSlot;
+	return true;
+}
+
+
+// Journal::open ****************************************************
+// ******************************************************************
+// two slots to check, whatever is in them
+//
+bool Journal::open()
+{
+	if( !mIsOpen )
+		return false;
+
+	JournalHeader h[2];
+	bool isValid[2];
+
+	for( uint8_t slot = 0; slot < 2; slot++ )
+		isValid[slot] = check( slot, &h[slot] );
+
+	if( !isValid[0] && !isValid[1] )
+	{
+		Serial1.println( "No checkpoint in the journal" );
+		return false;
+	}
+
+	if( isValid[0] && isValid[1] )
+		mLatest = h[1].mSequence > h[0].mSequence ? 1 : 0;
+	else
+		mLatest = isValid[1] ? 1 : 0;
+
+	if( !isValid[mLatest ^ 1] )
+		Serial1.println( "Torn checkpoint dropped" );
+
+	mSlot = mLatest;
+	mSequence = h[mLatest].mSequence;
+	mBodyLength = h[mLatest].mLength;
+	mLength = 0;
+
+	return mFile.seek( (uint32_t)mSlot * JOURNAL_SLOT_SZ + sizeof(JournalHeader) );
+}
+
+
+// Journal::read ****************************************************
+// ******************************************************************
+//
+bool Journal::read(void * data, uint16_t len)
+{
+	if( !mIsOpen || mLength + len > mBodyLength )
+		return false;
+
+	if( mFile.read( data, len ) != len )
+		return false;
+
+	mLength += len;
+	return true;
+}
+
+
+// Journal::check ***************************************************
+// ******************************************************************
+//
+bool Journal::check(uint8_t slot, JournalHeader * h)
+{
+	if( !mFile.seek( (uint32_t)slot * JOURNAL_SLOT_SZ ) || mFile.read( h, sizeof(*h) ) != sizeof(*h) )
+		return false;
+
+	if( h->mMagic != JOURNAL_MAGIC
+			|| h->mHeaderCrc != crcOf( 0xFFFF, (const uint8_t *)h, sizeof(*h) - sizeof(h->mHeaderCrc) )
+			|| h->mLength > JOURNAL_SLOT_SZ - sizeof(JournalHeader) )
+		return false;
+
+	uint8_t buf[32];
+	uint16_t crc = 0xFFFF;
+
+	for( uint16_t n = 0; n < h->mLength; )
+	{
+		uint16_t len = h->mLength - n < sizeof(buf) ? h->mLength - n : sizeof(buf);
+
+		if( mFile.read( buf, len ) != len )
+			return false;
+
+		crc = crcOf( crc, buf, len );
+		n += len;
+	}
+	return crc == h->mCrc;
+}
+
+
+// Journal::fail ****************************************************
+// ******************************************************************
+// the file is closed. Storage::serviceLog calls begin again after
+// JOURNAL_RETRY_MS
+//
+void Journal::fail()
+{
+	Serial1.println( "Failed to write " JOURNAL_FILE ". Is the SD inserted?" );
+	mFile.close();
+	mIsOpen = false;
+}
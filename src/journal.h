@@ -0,0 +1,117 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Checkpoint journal class
+ *
+ * Created on: 		2016-10-23
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <Arduino.h>
+#include <SD.h>
+#include "shield.h"
+#include "logFile.h"
+
+#define JOURNAL_FILE		"JOURNAL.BIN"
+#define JOURNAL_MAGIC		0x4A54		// "TJ"
+#define JOURNAL_SLOT_SZ		((MUX_WIDTH > 1 ? 4 : 2) * LOG_SECTOR_SZ)	// header and body of a checkpoint
+
+/*! @brief The header of a checkpoint, the commit marker. */
+struct JournalHeader
+{
+	uint16_t mMagic;			//!< JOURNAL_MAGIC
+	uint16_t mLength;			//!< bytes of the body that follows
+	uint32_t mSequence;			//!< the newer of the two slots has the higher one
+	uint16_t mCrc;				//!< of the body
+	uint16_t mHeaderCrc;		//!< of the bytes above
+} __attribute__((packed));
+
+
+/*! @brief Keeps the state that has to survive a reset on the SD card.
+ *
+ * The file has two slots of JOURNAL_SLOT_SZ bytes, written in turns. A
+ * checkpoint goes into the older slot: first the body, then the header. The
+ * header carries the CRC of the body and is the commit marker. A reset while
+ * writing leaves a slot whose CRCs do not match, it is dropped and the other
+ * slot, the previous checkpoint, is taken.
+ *
+ * The file is created at its full size and never grows, so a checkpoint does
+ * not touch the FAT or the directory, and finding the latest one is reading
+ * two slots, however long the device ran.
+ *
+ * The journal does not know what it keeps. The owner adds the pieces of a
+ * checkpoint with add() and reads them back in the same order with read().
+ */
+class Journal
+{
+public:
+	Journal();
+	virtual ~Journal() {};
+
+	/*!
+	 * @brief      Opens the file, creates it if it does not exist
+	 * @return     false if the SD card is not usable
+	 */
+	bool begin();
+
+	/*!
+	 * @brief      Starts a checkpoint in the older slot
+	 */
+	bool start();
+
+	/*!
+	 * @brief      Appends to the body of the checkpoint started
+	 * @return     false if the write failed or the slot is full. The checkpoint is dropped
+	 */
+	bool add(const void * data, uint16_t len);
+
+	/*!
+	 * @brief      Writes the body to the card. Optional, commit does it too
+	 */
+	bool sync();
+
+	/*!
+	 * @brief      Writes the header. Only then the checkpoint replaces the previous one
+	 */
+	bool commit();
+
+	/*!
+	 * @brief      Finds the latest complete checkpoint and gets ready to read it
+	 * @return     false if there is none
+	 */
+	bool open();
+
+	/*!
+	 * @brief      Reads the next piece of the checkpoint found by open()
+	 * @return     false past the end of the body
+	 */
+	bool read(void * data, uint16_t len);
+
+	uint32_t getSequence() { return mSequence; }	//!< of the latest checkpoint
+	bool isOpen() { return mIsOpen; }				//!< false after a failure, until begin succeeds again
+
+private:
+
+	bool check(uint8_t slot, JournalHeader * h);	//!< true if the slot holds a complete checkpoint
+	void fail();
+
+	File mFile;
+	bool mIsOpen;
+
+	uint8_t mSlot;				//!< being written or read
+	uint8_t mLatest;			//!< the slot of the latest complete checkpoint
+	uint32_t mSequence;
+	uint16_t mLength;			//!< of the body written or read so far
+	uint16_t mBodyLength;		//!< of the body being read
+	uint16_t mCrc;				//!< of the body written so far
+};
+
+
+#endif /* JOURNAL_H_ */
@@ -0,0 +1,205 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Log file class
+ *
+ * Created on: 		2016-10-19
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#include "logFile.h"
+
+
+LogFile::LogFile()
+{
+	mIsMounted = false;
+	mIsOpen = false;
+	mYear = 0;
+	mMonth = 0;
+	mFirstBlock = 0;
+	mCapacity = 0;
+	mWritten = 0;
+}
+
+
+// LogFile::begin ***************************************************
+// ******************************************************************
+//
+bool LogFile::begin()
+{
+	mIsMounted = mCard.init( SPI_HALF_SPEED, SD_CS_PIN, SD_MOSI_PIN, SD_MISO_PIN, SD_SCK_PIN )
+			&& mVolume.init( &mCard ) && mRoot.openRoot( &mVolume );
+
+	if( !mIsMounted )
+		Serial1.println( "error mounting the card for the log" );
+
+	return mIsMounted;
+}
+
+
+// LogFile::open ****************************************************
+// ******************************************************************
+// the header that is valid, of this file and has more sectors tells
+// where to go on
+//
+bool LogFile::open(int year, uint8_t month)
+{
+	if( mIsOpen && year == mYear && month == mMonth )
+		return true;
+
+	mIsOpen = false;
+
+	if( !mIsMounted )
+		return false;
+
+	char fileName[16];
+	sprintf( fileName, "%d%02d.LOG", year, month );
+
+	Serial1.print( "opening file " );
+	Serial1.println( fileName );
+
+	SdFile file;
+	uint32_t firstBlock, lastBlock;
+	uint32_t size = (LOG_FILE_HEADERS + LOG_FILE_CAPACITY) * LOG_SECTOR_SZ;
+	bool isCreated = false;
+
+	if( !file.open( &mRoot, fileName, O_READ ) )
+	{
+		if( !file.createContiguous( &mRoot, fileName, size ) )
+		{
+			Serial1.print( "error creating " );
+			Serial1.println( fileName );
+			return false;
+		}
+		isCreated = true;
+	}
+
+	bool isContiguous = file.contiguousRange( &firstBlock, &lastBlock );
+	uint32_t fileSize = file.fileSize();
+	file.close();
+
+	if( !isContiguous || lastBlock - firstBlock + 1 < LOG_FILE_HEADERS + 1 )
+	{
+		Serial1.print( fileName );
+		Serial1.println( " is not preallocated. Written by an older firmware? Rename it" );
+		return false;
+	}
+
+	mFirstBlock = firstBlock;
+	mCapacity = lastBlock - firstBlock + 1 - LOG_FILE_HEADERS;
+	mWritten = 0;
+
+	// the clusters of a new file are not cleared, whatever is in the
+	// header sectors is not looked at
+
+	bool isKnown = false;
+
+	for( uint8_t i = 0; i < LOG_FILE_HEADERS && !isCreated; i++ )
+	{
+		LogFileHeader h;
+
+		if( !mCard.readData( firstBlock + i, 0, sizeof(h), (uint8_t *)&h ) )
+		{
+			Serial1.println( "error reading the log header" );
+			return false;
+		}
+
+		if( isLogFileHeader(&h) && h.mFirstBlock == firstBlock )
+		{
+			isKnown = true;
+			if( h.mWritten > mWritten )
+				mWritten = h.mWritten;
+		}
+	}
+
+	// no header yet is fine for a file of the size created, nothing was
+	// written to it
+
+	if( !isKnown && !isCreated && fileSize != size )
+	{
+		Serial1.print( fileName );
+		Serial1.println( " has no log header. Written by an older firmware? Rename it" );
+		return false;
+	}
+
+	// empty headers right away, so that neither the leftovers of the card
+	// nor a header of a deleted log at the same place are taken for them.
+	// The volume cache is free once the file is closed
+
+	if( !isKnown )
+	{
+		uint8_t * sector = SdVolume::cacheClear();
+
+		for( uint8_t i = 0; i < LOG_FILE_HEADERS; i++ )
+		{
+			if( !writeHeader( sector, firstBlock + i ) )
+			{
+				Serial1.println( "error writing the log header" );
+				return false;
+			}
+		}
+	}
+
+	mIsOpen = true;
+	mYear = year;
+	mMonth = month;
+
+	return true;
+}
+
+
+// LogFile::write ***************************************************
+// ******************************************************************
+// the records first, then the header that counts them
+//
+bool LogFile::write(uint8_t * sector, uint16_t len)
+{
+	if( mIsOpen && mWritten >= mCapacity )
+	{
+		Serial1.println( "The log file of the month is full" );
+		return false;
+	}
+
+	if( len < LOG_SECTOR_SZ )
+		memset( sector + len, LOG_FILLER, LOG_SECTOR_SZ - len );
+
+	bool isOk = mIsOpen && mCard.writeBlock( mFirstBlock + LOG_FILE_HEADERS + mWritten, sector );
+
+	if( isOk )
+	{
+		mWritten++;
+		isOk = writeHeader( sector, mFirstBlock + mWritten % LOG_FILE_HEADERS );
+	}
+
+	if( !isOk )
+	{
+		Serial1.println( "Failed to log. Is the SD inserted? Do not forget to reset after insertion" );
+		mIsOpen = false;
+	}
+	return isOk;
+}
+
+
+// LogFile::writeHeader *********************************************
+// ******************************************************************
+// the rest of the sector is padding, the readers skip it
+//
+bool LogFile::writeHeader(uint8_t * sector, uint32_t block)
+{
+	memset( sector, LOG_FILLER, LOG_SECTOR_SZ );
+
+	LogFileHeader * h = (LogFileHeader *)sector;
+	h->mMagic = LOG_FILE_MAGIC;
+	h->mFiller = LOG_RECORD_FILLER;
+	h->mVersion = 1;
+	h->mCapacity = mCapacity;
+	h->mFirstBlock = mFirstBlock;
+	h->mWritten = mWritten;
+	h->mCrc = logCrc( h, sizeof(LogFileHeader) - sizeof(h->mCrc) );
+
+	return mCard.writeBlock( block, sector );
+}
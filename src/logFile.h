@@ -0,0 +1,101 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Log file class
+ *
+ * Created on: 		2016-10-19
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef LOGFILE_H_
+#define LOGFILE_H_
+
+#include <Arduino.h>
+#include <SD.h>
+#include "shield.h"
+#include "logRecord.h"
+
+#define LOG_SECTOR_SZ	512
+#define LOG_FILLER		0xFF		// pads a sector, skipped by the readers
+
+// a month of hourly records of all the channels and actuators, and a quarter
+// more for the partial sectors
+#define LOG_FILE_CAPACITY	(((CHANNEL_COUNT + ACTUATOR_COUNT) * 24L * 31 * sizeof(LogRecord) * 5 / 4 + LOG_SECTOR_SZ - 1) / LOG_SECTOR_SZ)
+
+/*! @brief The monthly log file, preallocated and written by block number.
+ *
+ * The file YYYYMM.LOG is created in one contiguous piece of LOG_FILE_HEADERS
+ * + LOG_FILE_CAPACITY sectors. From then on its sectors are written straight
+ * to the card, by the block number. Neither the FAT nor the directory are
+ * touched, so every write of the month costs the same two block writes: the
+ * sector of records and the header that tells how many there are, see
+ * LogFileHeader. The headers are written in turns, a reset while writing one
+ * leaves the other.
+ *
+ * The file is mounted through a card and volume of its own, on the same SPI
+ * pins as SD. The volume cache of the SD library is shared by all the volumes,
+ * so the files of SD and the raw writes do not get in the way of each other.
+ * The raw writes never go through the cache.
+ *
+ * A YYYYMM.LOG that is not in one piece or not of this layout, written by an
+ * older firmware, is left as it is and nothing is logged for the month.
+ */
+class LogFile
+{
+public:
+	LogFile();
+	virtual ~LogFile() {};
+
+	/*!
+	 * @brief      Mounts the card. After SD.begin
+	 * @return     false if the card is not usable
+	 */
+	bool begin();
+
+	/*!
+	 * @brief      Makes sure the file of the month is open.
+	 *
+	 * The file is created if it does not exist yet. The file of the previous
+	 * month is closed.
+	 *
+	 * @return     false if the file could not be opened or created
+	 */
+	bool open(int year, uint8_t month);
+
+	/*!
+	 * @brief      Writes the next sector of records
+	 * @param[in]  sector LOG_SECTOR_SZ bytes, used as the buffer of the header afterwards
+	 * @param[in]  len    bytes of records in it, the rest is padded
+	 * @return     false if the write failed or the file is full. A failed file is closed,
+	 *             the next open retries
+	 */
+	bool write(uint8_t * sector, uint16_t len);
+
+	void close() { mIsOpen = false; }
+
+	uint32_t size() { return mIsOpen ? (uint32_t)mWritten * LOG_SECTOR_SZ : 0; }	//!< bytes of records in the open file
+
+private:
+
+	bool writeHeader(uint8_t * sector, uint32_t block);	//!< the header of mWritten, in a sector of its own
+
+	Sd2Card mCard;
+	SdVolume mVolume;
+	SdFile mRoot;
+	bool mIsMounted;
+
+	bool mIsOpen;
+	int mYear;
+	uint8_t mMonth;
+
+	uint32_t mFirstBlock;		//!< of the file, the first header
+	uint16_t mCapacity;			//!< sectors for the records
+	uint16_t mWritten;			//!< sectors written
+};
+
+
+#endif /* LOGFILE_H_ */
@@ -0,0 +1,120 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Log queue class
+ *
+ * Created on: 		2016-10-22
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#include "logQueue.h"
+
+
+LogQueue::LogQueue()
+{
+	mTail = 0;
+	mWaiting = 0;
+	mFill = 0;
+	mDropped = 0;
+	mOverruns = 0;
+	mWorstSlice = 0;
+	mPeak = 0;
+}
+
+
+// LogQueue::push ***************************************************
+// ******************************************************************
+//
+bool LogQueue::push(const LogRecord & r, int year, uint8_t month)
+{
+	uint16_t key = year * 12 + month - 1;
+	uint8_t head = (mTail + mWaiting) % LOG_QUEUE_SECTORS;
+
+	// the sector being filled is of another month, it goes as it is
+
+	if( mFill && mMonth[head] != key && mWaiting < LOG_QUEUE_SECTORS )
+	{
+		mLength[head] = mFill;
+		mWaiting++;
+		mFill = 0;
+		head = (mTail + mWaiting) % LOG_QUEUE_SECTORS;
+
+		if( mWaiting > mPeak )
+			mPeak = mWaiting;
+	}
+
+	if( mWaiting == LOG_QUEUE_SECTORS )
+	{
+		mDropped++;
+		return false;
+	}
+
+	memcpy( mSectors[head] + mFill, &r, sizeof(r) );
+	mMonth[head] = key;
+	mFill += sizeof(r);
+
+	if( mFill == LOG_SECTOR_SZ )
+	{
+		mLength[head] = mFill;
+		mWaiting++;
+		mFill = 0;
+
+		if( mWaiting > mPeak )
+			mPeak = mWaiting;
+	}
+	return true;
+}
+
+
+// LogQueue::getPending *********************************************
+// ******************************************************************
+//
+uint16_t LogQueue::getPending(const uint8_t ** data, uint16_t * month)
+{
+	uint8_t head = (mTail + mWaiting) % LOG_QUEUE_SECTORS;
+
+	*data = mSectors[head];
+	*month = mMonth[head];
+	return mWaiting < LOG_QUEUE_SECTORS ? mFill : 0;
+}
+
+
+// LogQueue::drain **************************************************
+// ******************************************************************
+//
+bool LogQueue::drain()
+{
+	if( !mWaiting )
+		return true;
+
+	unsigned long start = micros();
+	bool isOk = true;
+
+	do
+	{
+		uint16_t key = mMonth[mTail];
+
+		if( !mFile.open( key / 12, key % 12 + 1 ) || !mFile.write( mSectors[mTail], mLength[mTail] ) )
+		{
+			mDropped += mLength[mTail] / sizeof(LogRecord);
+			isOk = false;
+		}
+
+		mTail = (mTail + 1) % LOG_QUEUE_SECTORS;
+		mWaiting--;
+
+	} while( mWaiting && isOk && micros() - start < LOG_SLICE_US );
+
+	unsigned long slice = micros() - start;
+
+	if( slice > mWorstSlice )
+		mWorstSlice = slice;
+	if( slice > LOG_SLICE_US )
+		mOverruns++;
+
+	return isOk;
+}
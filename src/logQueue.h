@@ -0,0 +1,110 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Log queue class
+ *
+ * Created on: 		2016-10-22
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef LOGQUEUE_H_
+#define LOGQUEUE_H_
+
+#include <Arduino.h>
+#include "shield.h"
+#include "logFile.h"
+#include "logRecord.h"
+
+// sectors of records in RAM. An hour of records fits in less than 2
+#define LOG_QUEUE_SECTORS	(MUX_WIDTH > 1 ? 3 : 2)
+#define LOG_SLICE_US		2000	// no new SD operation is started after that long in a pass
+
+/*! @brief Decouples the SD card from the control loop.
+ *
+ * The records are pushed into a ring of sector buffers, which takes a copy
+ * of 16 bytes. The full sectors are written by drain(), which the loop calls
+ * on every pass. A write takes a couple of ms, or 100+ ms when the card
+ * erases. It cannot be split, so a pass starts at most the SD operations that
+ * fit in LOG_SLICE_US, and always at least one. That is one sector write, the
+ * records and the header, or one file open per pass in practice.
+ *
+ * If all the sectors are waiting for the card, the new records are dropped
+ * and counted. The records in the queue are kept, so the log has a gap but
+ * no holes inside of what was written.
+ *
+ * Up to a sector of records waits until it is full, a few hours. A record of
+ * another month closes the sector it would go to, partial.
+ */
+class LogQueue
+{
+public:
+	LogQueue();
+	virtual ~LogQueue() {};
+
+	/*!
+	 * @brief      Mounts the card for the log files. After SD.begin
+	 */
+	bool begin() { return mFile.begin(); }
+
+	/*!
+	 * @brief      Queues a record of the month. O(1), no SD access
+	 * @return     false if the queue is full and the record is dropped
+	 */
+	bool push(const LogRecord & r, int year, uint8_t month);
+
+	/*!
+	 * @brief      Writes the full sectors, for about LOG_SLICE_US
+	 *
+	 * Shall be called once per loop pass.
+	 *
+	 * @return     false if a sector could not be written and is dropped
+	 */
+	bool drain();
+
+	/*!
+	 * @brief      True if no sector waits for the card. Only the one being filled is in RAM
+	 */
+	bool isIdle() { return !mWaiting; }
+
+	/*!
+	 * @brief      The records of the sector being filled, not on the card yet
+	 * @param[out] month year * 12 + month - 1 of the records
+	 * @return     bytes of records, 0 if none
+	 */
+	uint16_t getPending(const uint8_t ** data, uint16_t * month);
+
+	/*!
+	 * @brief      The bytes of records in the file of the month, opens it. An SD operation
+	 * @return     0 if it could not be opened
+	 */
+	uint32_t getFileSize(uint16_t month) { return mFile.open( month / 12, month % 12 + 1 ) ? mFile.size() : 0; }
+
+	unsigned long getDropped() { return mDropped; }		//!< records dropped so far
+	uint16_t getOverruns() { return mOverruns; }		//!< passes longer than LOG_SLICE_US
+	unsigned long getWorstSlice() { return mWorstSlice; }	//!< us
+	uint8_t getPeak() { return mPeak; }					//!< most sectors waiting at once
+
+private:
+
+	uint8_t mSectors[LOG_QUEUE_SECTORS][LOG_SECTOR_SZ];
+	uint16_t mLength[LOG_QUEUE_SECTORS];	//!< bytes of a waiting sector
+	uint16_t mMonth[LOG_QUEUE_SECTORS];		//!< year * 12 + month - 1 of the records in it
+
+	uint8_t mTail;							//!< the oldest waiting sector
+	uint8_t mWaiting;						//!< sectors waiting to be written
+	uint16_t mFill;							//!< bytes in the sector being filled, after the waiting ones
+
+	LogFile mFile;
+
+	unsigned long mDropped;
+	uint16_t mOverruns;
+	unsigned long mWorstSlice;
+	uint8_t mPeak;
+};
+
+
+#endif /* LOGQUEUE_H_ */
@@ -0,0 +1,118 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Binary log record
+ *
+ * Created on: 		2016-10-20
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef LOGRECORD_H_
+#define LOGRECORD_H_
+
+// shared with the host tools (tools/logdecode.cpp), so no Arduino here
+
+#include <stdint.h>
+
+#define LOG_RECORD_ACTUATOR	0x80	// mChannel of the actuator records, | actuator id
+#define LOG_RECORD_FILLER	0xFF	// all the bytes of the padding, see LogFile
+#define LOG_FILE_MAGIC		0x474C5354UL	// "TSLG"
+#define LOG_FILE_HEADERS	2		// sectors in front of the records, see LogFileHeader
+
+/*! @brief Flags of a log record */
+enum {
+	log_flag_on			= 0x01,		/*!< the channel or actuator was on when logged */
+	log_flag_forced		= 0x02,		/*!< forced by the button */
+	log_flag_rule		= 0x04,		/*!< forced by the rules */
+	log_flag_mode_mask	= 0x30,		/*!< ControlMode_t << 4 */
+	log_flag_mode_shift	= 4
+};
+
+
+/*! @brief One hourly log record of a channel or an actuator.
+ *
+ * 16 bytes, little endian as both the AVR and the PC are, so 32 of them fill
+ * a sector. The CRC covers the bytes before it.
+ */
+struct LogRecord
+{
+	uint32_t mTime;				//!< seconds since 1970, the RTC time (local)
+	uint8_t mChannel;			//!< 0...CHANNEL_COUNT-1, or LOG_RECORD_ACTUATOR | actuator
+	uint8_t mFlags;
+	int16_t mTemperature;		//!< average of the period, one hundredth of centigrade, calibration applied. 0 for actuators
+	uint16_t mDuty;				//!< one hundredth of percent of the logging period
+	uint16_t mToggles;			//!< within the logging period
+	uint8_t mBelow;				//!< the min of the period is that much below the average, 0.1C
+	uint8_t mAbove;				//!< the max of the period is that much above the average, 0.1C
+	uint16_t mCrc;				//!< CRC-16 (0xA001, init 0xFFFF) of the bytes above
+} __attribute__((packed));
+
+typedef char LogRecordSizeCheck[sizeof(LogRecord) == 16 ? 1 : -1];
+
+
+/*! @brief The header of a monthly log file.
+ *
+ * The file is preallocated in one piece, see LogFile. Its first two sectors
+ * are headers, written in turns, each in front of LOG_RECORD_FILLER bytes. The
+ * valid one with more sectors written tells where the records end. The rest
+ * of the file is whatever was on the card before.
+ *
+ * The header is laid out as a record with mChannel LOG_RECORD_FILLER, so the
+ * readers that skip the padding skip it as well.
+ */
+struct LogFileHeader
+{
+	uint32_t mMagic;			//!< LOG_FILE_MAGIC
+	uint8_t mFiller;			//!< LOG_RECORD_FILLER, where mChannel of a record is
+	uint8_t mVersion;			//!< 1
+	uint16_t mCapacity;			//!< sectors for the records, after the headers
+	uint32_t mFirstBlock;		//!< the block of the file on the card, a header left by a deleted file does not match
+	uint16_t mWritten;			//!< sectors of records written
+	uint16_t mCrc;				//!< CRC-16 of the bytes above
+} __attribute__((packed));
+
+typedef char LogFileHeaderSizeCheck[sizeof(LogFileHeader) == sizeof(LogRecord) ? 1 : -1];
+
+
+/*!
+ * @brief      CRC-16 (0xA001, init 0xFFFF), same as _crc16_update of avr-libc
+ */
+static inline uint16_t logCrc(const void * data, uint8_t len)
+{
+	const uint8_t * p = (const uint8_t *)data;
+	uint16_t crc = 0xFFFF;
+
+	for( uint8_t i = 0; i < len; i++ )
+	{
+		crc ^= p[i];
+
+		for( uint8_t k = 0; k < 8; k++ )
+			crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	return crc;
+}
+
+
+/*!
+ * @brief      The CRC of the record
+ */
+static inline uint16_t logRecordCrc(const LogRecord * r)
+{
+	return logCrc(r, sizeof(LogRecord) - sizeof(r->mCrc));
+}
+
+
+/*!
+ * @brief      Checks the header read from the card
+ */
+static inline bool isLogFileHeader(const LogFileHeader * h)
+{
+	return h->mMagic == LOG_FILE_MAGIC && h->mCrc == logCrc(h, sizeof(LogFileHeader) - sizeof(h->mCrc));
+}
+
+
+#endif /* LOGRECORD_H_ */
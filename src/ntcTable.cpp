@@ -0,0 +1,110 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * NTC lookup tables
+ *
+ * Created on: 		2016-09-20
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+#include "Arduino.h"
+#include "ntcTable.h"
+
+// all of these are calculated by the compiler
+
+static const int16_t mf52_10k[NTC_KNOT_COUNT] PROGMEM = NTC_TABLE(10000, 3435);
+static const int16_t b57861_5k[NTC_KNOT_COUNT] PROGMEM = NTC_TABLE(5000, 3988);
+static const int16_t mf58_100k[NTC_KNOT_COUNT] PROGMEM = NTC_TABLE(100000, 3950);
+
+
+const NtcCurve NtcCurves[NTC_TYPE_COUNT] PROGMEM = {
+	{ 10000, 3435, mf52_10k },
+	{ 5000, 3988, b57861_5k },
+	{ 100000, 3950, mf58_100k }
+};
+
+
+
+static inline int16_t knotAt(const int16_t * knots, uint8_t i, bool isRam)
+{
+	return isRam ? knots[i] : (int16_t)pgm_read_word( &knots[i] );
+}
+
+
+
+int16_t ntcLookup(const int16_t * knots, uint16_t reading, bool isRam)
+{
+	uint8_t i = reading >> NTC_KNOT_SHIFT;
+
+	if( i >= NTC_KNOT_COUNT - 1 )
+		return knotAt( knots, NTC_KNOT_COUNT - 1, isRam );
+
+	int16_t t0 = knotAt( knots, i, isRam );
+	int16_t t1 = knotAt( knots, i + 1, isRam );
+
+	return t0 + (int16_t)(((long)(t1 - t0) * (reading & ((1 << NTC_KNOT_SHIFT) - 1))) >> NTC_KNOT_SHIFT);
+}
+
+
+
+uint16_t ntcReadingAtOrBelow(const int16_t * knots, int16_t t, bool isRam)
+{
+	// binary search, ntcLookup does not increase with the reading
+
+	uint16_t lo = 0;
+	uint16_t hi = NTC_READING_END;
+
+	while( lo < hi )
+	{
+		uint16_t mid = (lo + hi) / 2;
+
+		if( ntcLookup(knots, mid, isRam) <= t )
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+
+
+int16_t * ntcBuildTable(const NtcParams & params)
+{
+	int16_t * knots = new int16_t[NTC_KNOT_COUNT];
+
+	if( !knots )
+		return NULL;
+
+	for( uint8_t k = 0; k < NTC_KNOT_COUNT; k++ )
+	{
+		int code = ntcKnotCode(k);
+		double t;
+
+		if( params.mModel == ntc_steinhart )
+		{
+			double lnR = log( (double)params.mR0 * code / (1023.0 - code) );
+			t = 1.0 / (params.mA + params.mB * lnR + params.mC * lnR * lnR * lnR) - 273.15;
+		}
+		else
+		{
+			t = ntcCelsius( params.mR0, params.mA, params.mR0, code );
+		}
+
+		// coefficients off the range give NaN or the wrong sign. Clipped, and
+		// kept falling with the reading for ntcReadingAtOrBelow
+
+		if( !(t > NTC_T_MIN / 100.0) )
+			t = NTC_T_MIN / 100.0;
+		else if( t > NTC_T_MAX / 100.0 )
+			t = NTC_T_MAX / 100.0;
+
+		knots[k] = ntcRound(t * 100.0);
+
+		if( k > 0 && knots[k] > knots[k - 1] )
+			knots[k] = knots[k - 1];
+	}
+	return knots;
+}
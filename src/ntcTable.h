@@ -0,0 +1,164 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * NTC lookup tables
+ *
+ * Created on: 		2016-09-20
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef NTCTABLE_H_
+#define NTCTABLE_H_
+
+#include <Arduino.h>
+
+#define NTC_KNOT_COUNT	65			// a knot every 16 ADC codes, 0...1024
+#define NTC_KNOT_SHIFT	8			// readings between two knots (16 codes x 16 samples)
+
+#define NTC_READING_END	((NTC_KNOT_COUNT - 1) << NTC_KNOT_SHIFT)	// past the largest reading
+
+#define NTC_T_MIN		-5500		// the tables are clipped to -55.00C...
+#define NTC_T_MAX		15000		// ...+150.00C
+
+#define NTC_CUSTOM_COUNT	4		// thermistors given by their parameters in config.txt
+
+
+/*! @brief The thermistors the firmware knows of.
+ *
+ * The type is an index into NtcCurves. The tables are generated by the
+ * compiler, so a new type costs 130 bytes of flash and no RAM.
+ */
+typedef enum NtcType {
+	ntc_mf52_10k,		/*!< Cantherm MF52, R0 = 10K, B = 3435 (doc/cantherm_mf52_1.pdf) */
+	ntc_b57861_5k,		/*!< EPCOS B57861S, R0 = 5K, B = 3988 (doc/EPCOS-NTC-Heissleiter_S861_5K_F40_B57861.pdf) */
+	ntc_mf58_100k,		/*!< Cantherm MF58, R0 = 100K, B = 3950 */
+	NTC_TYPE_COUNT
+} NtcType_t;
+
+
+/*! @brief Describes a thermistor and its lookup table.
+ *
+ * The table maps the reading (the sum of 16 ADC conversions, i.e. the ADC
+ * code in 1/16 LSB) to the temperature in one hundredth of centigrade. It is
+ * calculated for the divider pulled up by a resistor equal to R0.
+ */
+struct NtcCurve
+{
+	long mR0;					//!< resistance at 25C
+	int mBeta;					//!< B value as per data sheet
+	const int16_t * mKnots;		//!< NTC_KNOT_COUNT temperatures, in PROGMEM
+};
+
+extern const NtcCurve NtcCurves[NTC_TYPE_COUNT] PROGMEM;
+
+
+/*! @brief The models a thermistor may be given by in config.txt */
+typedef enum NtcModel {
+	ntc_beta,			/*!< mA is B */
+	ntc_steinhart		/*!< 1/T = mA + mB ln(R) + mC ln(R)^3, T in K */
+} NtcModel_t;
+
+/*! @brief A thermistor given by its parameters, kept with the configuration.
+ *
+ * Its table is built in RAM once, when the configuration is taken, see
+ * ntcBuildTable. The conversions do not see a difference.
+ */
+struct NtcParams
+{
+	long mR0;				//!< the resistance the divider is pulled up by, at 25C for ntc_beta
+	uint8_t mModel;			//!< one of NtcModel_t
+	float mA;
+	float mB;
+	float mC;
+} __attribute__((packed));
+
+
+// The following is only used by the compiler to generate the tables.
+// This is the same approximation of the Steinhart-Hart equation as in
+// AdcChannel::getTemperature:
+// temp = 1.0/(1.0/298.15 + 1.0/B*log(Rth/R0))-273.15
+// where Rth = Rpull * code / (1023 - code)
+
+constexpr int ntcKnotCode(int k)
+{
+	return k == 0 ? 1 : (k * 16 > 1022 ? 1022 : k * 16);		// the rails would give infinity
+}
+
+constexpr double ntcCelsius(double r0, double beta, double rPull, int code)
+{
+	return 1.0 / (1.0 / 298.15 + __builtin_log(rPull * code / (1023.0 - code) / r0) / beta) - 273.15;
+}
+
+constexpr long ntcRound(double t)
+{
+	return (long)(t < 0 ? t - 0.5 : t + 0.5);
+}
+
+constexpr int16_t ntcClip(long t)
+{
+	return (int16_t)(t < NTC_T_MIN ? NTC_T_MIN : (t > NTC_T_MAX ? NTC_T_MAX : t));
+}
+
+constexpr int16_t ntcKnot(double r0, double beta, double rPull, int k)
+{
+	return ntcClip(ntcRound(ntcCelsius(r0, beta, rPull, ntcKnotCode(k)) * 100.0));
+}
+
+#define NTC_K(r0, b, k)		ntcKnot(r0, b, r0, k)
+#define NTC_K8(r0, b, k)	NTC_K(r0, b, k), NTC_K(r0, b, k+1), NTC_K(r0, b, k+2), NTC_K(r0, b, k+3), \
+							NTC_K(r0, b, k+4), NTC_K(r0, b, k+5), NTC_K(r0, b, k+6), NTC_K(r0, b, k+7)
+
+//! The initializer of a table for the thermistor (r0, b) pulled up by r0
+#define NTC_TABLE(r0, b)	{ NTC_K8(r0, b, 0), NTC_K8(r0, b, 8), NTC_K8(r0, b, 16), NTC_K8(r0, b, 24), \
+							  NTC_K8(r0, b, 32), NTC_K8(r0, b, 40), NTC_K8(r0, b, 48), NTC_K8(r0, b, 56), \
+							  NTC_K(r0, b, 64) }
+
+
+/*!
+ * @brief      Converts the reading to temperature
+ *
+ * Linear interpolation between the two neighboring knots. No float,
+ * no division.
+ *
+ * @param[in]  knots   the table
+ * @param[in]  reading the sum of 16 ADC conversions
+ * @param[in]  isRam   the table is in RAM, see ntcBuildTable. Otherwise in PROGMEM
+ *
+ * @return     Temperature in one hundredth of centigrade
+ */
+int16_t ntcLookup(const int16_t * knots, uint16_t reading, bool isRam = false);
+
+
+/*!
+ * @brief      Inverse of ntcLookup
+ *
+ * The temperature falls as the reading grows, so the readings at or above
+ * the returned one are all at or below t. Used to turn the thresholds into
+ * readings once, instead of converting every reading to compare it.
+ *
+ * @param[in]  knots   the table in PROGMEM
+ * @param[in]  t       temperature in one hundredth of centigrade
+ *
+ * @return     The smallest reading converting to t or below, NTC_READING_END
+ *             if none does
+ */
+uint16_t ntcReadingAtOrBelow(const int16_t * knots, int16_t t, bool isRam = false);
+
+
+/*!
+ * @brief      Builds the table of a thermistor given by its parameters
+ *
+ * The same knots as the compiler makes for NtcCurves, only in float at
+ * runtime. Only to be used when the configuration is loaded.
+ *
+ * @return     NTC_KNOT_COUNT temperatures on the heap, NULL if out of RAM.
+ *             To be released with delete[]
+ */
+int16_t * ntcBuildTable(const NtcParams & params);
+
+
+#endif /* NTCTABLE_H_ */
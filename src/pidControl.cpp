@@ -0,0 +1,72 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Duty cycle controllers
+ *
+ * Created on: 		2016-10-17
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#include "pidControl.h"
+
+static const unsigned long MAX_DT = 600000;		// longer gaps are taken as 10 min (ms)
+static const int16_t MAX_ERROR = 2000;			// the error integrated is clipped to 20C
+
+
+PidControl::PidControl(int16_t kp, int16_t ki, int16_t kd)
+{
+	mKp = kp;
+	mKi = ki;
+	mKd = kd;
+	mIntegral = 0;
+	mLastTemperature = 0;
+	mLastTime = 0;
+	mIsStarted = false;
+}
+
+
+// PidControl::update ***********************************************
+// ******************************************************************
+//
+uint8_t PidControl::update(int16_t setPoint, int16_t temperature, unsigned long now)
+{
+	unsigned long dt = 0;
+
+	if( mIsStarted )
+	{
+		dt = now - mLastTime;
+		if( dt > MAX_DT )
+			dt = MAX_DT;
+	}
+
+	int16_t e = constrain((int16_t)(setPoint - temperature), (int16_t)-MAX_ERROR, MAX_ERROR);
+
+	long p = (long)mKp * e / 100;
+
+	// rate in C/min is dT / 100 / (dt / 60000)
+
+	long d = 0;
+	if( dt )
+		d = -(long)mKd * (temperature - mLastTemperature) * 600 / (long)dt;
+
+	long out = p + (mIntegral >> 8) + d;
+
+	if( dt && !(out > DUTY_MAX && e > 0) && !(out < 0 && e < 0) )
+	{
+		// ki * e/100 * dt/3600000 in duty, * 256
+
+		mIntegral += (long)mKi * e * (long)(dt / 1000) / 1406;
+		mIntegral = constrain(mIntegral, 0L, (long)DUTY_MAX << 8);
+		out = p + (mIntegral >> 8) + d;
+	}
+
+	mLastTemperature = temperature;
+	mLastTime = now;
+	mIsStarted = true;
+
+	return constrain(out, 0L, (long)DUTY_MAX);
+}
@@ -0,0 +1,86 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Duty cycle controllers
+ *
+ * Created on: 		2016-10-17
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef PIDCONTROL_H_
+#define PIDCONTROL_H_
+
+#include <Arduino.h>
+
+#define DUTY_MAX		255		// the duty cycle is 0...DUTY_MAX
+
+/*! @brief Enumerates how a channel decides on its actuators. */
+typedef enum ControlMode {
+	control_hysteresis,		/*!< on below the low limit, off above the high one */
+	control_proportional,	/*!< duty cycle 100% at the low limit down to 0% at the high one */
+	control_pid,			/*!< PID around the middle of the limits */
+	CONTROL_MODE_COUNT
+} ControlMode_t;
+
+
+/*! @brief PID controller with the duty cycle as the output.
+ *
+ * Fixed point, the temperatures are in one hundredth of centigrade as
+ * everywhere else. The channels are sampled at an adaptive period, so every
+ * update takes the time elapsed since the previous one.
+ *
+ * The integral is only accumulated while the output is not saturated in the
+ * direction of the error (conditional integration), so it does not wind up
+ * while the actuator is already at 0% or 100%. The derivative acts on the
+ * temperature, not on the error, so a change of the set point does not kick
+ * the output.
+ */
+class PidControl
+{
+public:
+
+	/*!
+	 * @param[in]  kp duty per centigrade of error
+	 * @param[in]  ki duty per centigrade of error and hour
+	 * @param[in]  kd duty per centigrade per minute of temperature change
+	 */
+	PidControl(int16_t kp = defaultKp, int16_t ki = defaultKi, int16_t kd = defaultKd);
+	virtual ~PidControl() {};
+
+	/*!
+	 * @brief      Takes a new temperature
+	 * @param[in]  setPoint    in one hundredth of centigrade
+	 * @param[in]  temperature in one hundredth of centigrade
+	 * @param[in]  now         millis() of the reading
+	 * @return     The duty cycle, 0...DUTY_MAX
+	 */
+	uint8_t update(int16_t setPoint, int16_t temperature, unsigned long now);
+
+	/*!
+	 * @brief      Forgets the history, e.g. while the channel is forced
+	 */
+	void reset() { mIsStarted = false; mIntegral = 0; }
+
+	static const int16_t defaultKp = 100;
+	static const int16_t defaultKi = 50;
+	static const int16_t defaultKd = 0;
+
+private:
+
+	int16_t mKp;
+	int16_t mKi;
+	int16_t mKd;
+
+	long mIntegral;					//!< the I term, duty * 256
+
+	int16_t mLastTemperature;
+	unsigned long mLastTime;
+	bool mIsStarted;
+};
+
+
+#endif /* PIDCONTROL_H_ */
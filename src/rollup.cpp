@@ -0,0 +1,74 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Per channel statistics of the logging intervals
+ *
+ * Created on: 		2016-10-21
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#include "rollup.h"
+
+
+// quantize *********************************************************
+// ******************************************************************
+// to the nearest 0.1C, in 0.1C
+//
+static int quantize(int16_t t)
+{
+	return (t >= 0 ? t + ROLLUP_DELTA_UNIT / 2 : t - ROLLUP_DELTA_UNIT / 2) / ROLLUP_DELTA_UNIT;
+}
+
+
+// Rollup::close ****************************************************
+// ******************************************************************
+// the new interval becomes mLatest, the difference to the previous
+// mLatest goes in front of the deltas. The differences are taken
+// between the values rounded to 0.1C, so the older intervals come
+// back rounded but do not drift
+//
+void Rollup::close(int16_t average)
+{
+	if( mDepth )
+	{
+		int delta = quantize(average) - quantize(mLatest);
+
+		mHead = mHead ? mHead - 1 : ROLLUP_DEPTH - 2;
+		mDeltas[mHead] = constrain(delta, -127, 127);
+	}
+
+	mLatest = average;
+
+	if( mDepth < ROLLUP_DEPTH )
+		mDepth++;
+
+	reset();
+}
+
+
+// Rollup::getHistory ***********************************************
+// ******************************************************************
+//
+int16_t Rollup::getHistory(uint8_t age)
+{
+	if( age >= mDepth )
+		return ROLLUP_NONE;
+
+	if( age == 0 )
+		return mLatest;
+
+	int t = quantize(mLatest);
+	uint8_t k = mHead;
+
+	for( uint8_t i = 0; i < age; i++ )
+	{
+		t -= mDeltas[k];
+		if( ++k == ROLLUP_DEPTH - 1 )
+			k = 0;
+	}
+	return t * ROLLUP_DELTA_UNIT;
+}
@@ -0,0 +1,97 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Per channel statistics of the logging intervals
+ *
+ * Created on: 		2016-10-21
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef ROLLUP_H_
+#define ROLLUP_H_
+
+#include <Arduino.h>
+#include "shield.h"
+
+// the closed intervals kept, a day without the multiplexer
+#define ROLLUP_DEPTH		(MUX_WIDTH > 1 ? 8 : 24)
+#define ROLLUP_DELTA_UNIT	10			// the history is kept in 0.1C
+#define ROLLUP_NONE			INT16_MIN	// no such interval
+
+/*! @brief Folds every reading of a channel into the statistics of the interval.
+ *
+ * The current interval keeps the min, the max and the sum of the readings,
+ * not of the temperatures. So a reading costs a couple of compares and an
+ * addition, and the conversion is only done when the interval is closed.
+ * The temperature falls as the reading grows, the min reading is the max
+ * temperature. The average of the readings is converted as if the table was
+ * linear between them, which it nearly is within an hour's swing.
+ *
+ * The averages of the closed intervals are kept in a ring, the latest in full
+ * and the older ones as the int8 difference to the next one, in 0.1C. So a
+ * day of history costs a byte per hour. A difference beyond 12.7C is clipped,
+ * the older intervals then are off by the rest.
+ */
+class Rollup
+{
+public:
+	Rollup() { reset(); mDepth = 0; mHead = 0; mLatest = 0; };
+
+	/*!
+	 * @brief      Takes a reading into the current interval
+	 */
+	void fold(uint16_t reading)
+	{
+		if( reading < mMin ) mMin = reading;
+		if( reading > mMax ) mMax = reading;
+		mSum += reading;
+		mCount++;
+	}
+
+	bool isEmpty() { return mCount == 0; }
+
+	uint16_t getMinReading() { return mMin; }		//!< valid if not isEmpty
+	uint16_t getMaxReading() { return mMax; }		//!< valid if not isEmpty
+	uint16_t getAverageReading() { return mCount ? mSum / mCount : 0; }
+	uint16_t getCount() { return mCount; }
+	unsigned long getSum() { return mSum; }
+
+	/*!
+	 * @brief      Puts back the current interval as it was saved, see Storage::checkpoint
+	 */
+	void restore(uint16_t min, uint16_t max, unsigned long sum, uint16_t count) { mMin = min; mMax = max; mSum = sum; mCount = count; }
+
+	/*!
+	 * @brief      Closes the current interval and starts the next one
+	 * @param[in]  average the average temperature of the interval, one hundredth of C
+	 */
+	void close(int16_t average);
+
+	/*!
+	 * @brief      The average temperature of a closed interval
+	 * @param[in]  age 0 for the latest closed one, up to ROLLUP_DEPTH - 1
+	 * @return     one hundredth of C, ROLLUP_NONE if not that many intervals are closed yet
+	 */
+	int16_t getHistory(uint8_t age);
+
+private:
+
+	void reset() { mMin = 0xFFFF; mMax = 0; mSum = 0; mCount = 0; }
+
+	uint16_t mMin;
+	uint16_t mMax;
+	unsigned long mSum;
+	uint16_t mCount;
+
+	int16_t mLatest;					//!< the average of the latest closed interval
+	int8_t mDeltas[ROLLUP_DEPTH - 1];	//!< [i] = interval i - interval i+1, in 0.1C, from mHead on
+	uint8_t mHead;
+	uint8_t mDepth;						//!< number of intervals kept
+};
+
+
+#endif /* ROLLUP_H_ */
@@ -0,0 +1,404 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Control rule interpreter
+ *
+ * Created on: 		2016-10-15
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#include "ruleVm.h"
+#include "storage.h"
+
+extern Storage Store;
+
+
+RuleVm::RuleVm()
+{
+	clear();
+	mMinutes = 0;
+}
+
+
+// RuleVm::clear ****************************************************
+// ******************************************************************
+//
+void RuleVm::clear()
+{
+	mCode[0] = op_end;
+	mSize = 0;
+	mIsFull = false;
+	mPc = 0;
+	mSp = 0;
+	mIsFaulty = false;
+}
+
+
+// RuleVm::compile **************************************************
+// ******************************************************************
+// RULE [NOT] <cond> [AND [NOT] <cond> ...] THEN <action>
+//
+ConfigStatus_t RuleVm::compile(const ConfigLine & line, uint8_t * at)
+{
+	uint8_t prevSize = mSize;
+	mSize = mSize ? mSize - 1 : 0;		// overwrite op_end
+	mIsFull = false;
+
+	uint8_t i = 1;						// after RULE
+	bool isFirst = true;
+	bool isOk = true;
+	ConfigStatus_t error = config_rule;
+
+	while( isOk )
+	{
+		bool isNot = line.is(i, "NOT");
+		if( isNot )
+			i++;
+
+		const char * tok = line.token(i);
+
+		if( !tok )
+		{
+			isOk = false;
+		}
+		else if( !strcmp(tok, "TIME") )
+		{
+			int h1, m1, h2, m2;
+			tok = line.token(++i);
+
+			if( !tok || sscanf(tok, "%d:%d-%d:%d", &h1, &m1, &h2, &m2) != 4 )
+			{
+				isOk = false;
+			}
+			else if( h1 < 0 || h1 > 23 || m1 < 0 || m1 > 59 || h2 < 0 || h2 > 23 || m2 < 0 || m2 > 59 )
+			{
+				error = config_number;
+				isOk = false;
+			}
+			else
+			{
+				int16_t from = h1 * 60 + m1;
+				int16_t to = h2 * 60 + m2;
+
+				// within [from, to), or either side of midnight if it wraps
+
+				isOk = emit(op_time) && emit(op_const) && emitWord(from) && emit(op_lt) && emit(op_not)
+					&& emit(op_time) && emit(op_const) && emitWord(to) && emit(op_lt)
+					&& emit(from <= to ? op_and : op_or);
+				i++;
+			}
+		}
+		else if( tok[0] == 'T' )
+		{
+			const char * cmp = line.token(i + 1);
+			error = config_channel;
+			isOk = emit(op_temp) && emitChannel(tok, 1);
+
+			if( isOk )
+			{
+				error = config_rule;
+				i++;
+				isOk = cmp && (!strcmp(cmp, "<") || !strcmp(cmp, ">"));
+			}
+			if( isOk )
+			{
+				error = config_number;
+				i++;
+				isOk = emitValue(line.token(i)) && emit(cmp[0] == '<' ? op_lt : op_gt);
+			}
+			if( isOk )
+			{
+				error = config_rule;
+				i++;
+			}
+		}
+		else
+		{
+			isOk = false;
+		}
+
+		if( isOk && isNot )
+			isOk = emit(op_not);
+
+		if( isOk && !isFirst )
+			isOk = emit(op_and);
+
+		isFirst = false;
+
+		if( !isOk || !line.is(i, "AND") )
+			break;
+		i++;
+	}
+
+	if( isOk && !line.is(i, "THEN") )
+		isOk = false;
+
+	// skip the action if the condition is false
+
+	uint8_t jump = mSize + 1;
+	isOk = isOk && emit(op_jz) && emit(0);
+
+	if( isOk )
+	{
+		const char * action = line.token(++i);
+		const char * channel = line.token(i + 1);
+
+		if( !action )
+		{
+			isOk = false;
+		}
+		else if( !strcmp(action, "SHIFT") || !strcmp(action, "ON") || !strcmp(action, "OFF") )
+		{
+			error = config_channel;
+			i++;
+			isOk = emit(action[1] == 'H' ? op_shift : action[1] == 'N' ? op_on : op_off) && emitChannel(channel, 2);
+
+			if( isOk && action[1] == 'H' )
+			{
+				error = config_number;
+				i++;
+				int value;
+				isOk = toValue(line.token(i), &value) && emitWord(value * 100);
+			}
+		}
+		else
+		{
+			isOk = false;
+		}
+	}
+
+	if( isOk )
+	{
+		mCode[jump] = mSize - jump - 1;
+		isOk = emit(op_end);
+	}
+
+	if( !isOk )
+	{
+		*at = i;
+		mSize = prevSize;
+		if( mSize )
+			mCode[mSize - 1] = op_end;
+		return mIsFull ? config_rules_full : error;
+	}
+
+	mPc = 0;				// start over with the new program
+	return config_ok;
+}
+
+
+// RuleVm::emit *****************************************************
+// ******************************************************************
+//
+bool RuleVm::emit(uint8_t byte)
+{
+	if( mSize >= RULE_CODE_SIZE )
+	{
+		mIsFull = true;
+		return false;
+	}
+	mCode[mSize++] = byte;
+	return true;
+}
+
+
+// RuleVm::emitChannel **********************************************
+// ******************************************************************
+// T<x> or CH<x>, counted from 1 towards the user
+//
+bool RuleVm::emitChannel(const char * token, uint8_t skip)
+{
+	int ch;
+
+	if( !token || strlen(token) <= skip || !ConfigLine::toInt(token + skip, &ch) )
+		return false;
+
+	ch--;
+
+	if( ch < 0 || ch >= CHANNEL_COUNT )
+		return false;
+
+	return emit(ch);
+}
+
+
+// RuleVm::emitValue ************************************************
+// ******************************************************************
+// in C, pushed in one hundredth of C
+//
+bool RuleVm::emitValue(const char * token)
+{
+	int value;
+	return toValue(token, &value) && emit(op_const) && emitWord(value * 100);
+}
+
+
+// RuleVm::toValue **************************************************
+// ******************************************************************
+// in C, up to what fits int16 in one hundredth of C
+//
+bool RuleVm::toValue(const char * token, int * value)
+{
+	return ConfigLine::toInt(token, value) && *value >= -RULE_VALUE_MAX && *value <= RULE_VALUE_MAX;
+}
+
+
+bool RuleVm::emitWord(int16_t value)
+{
+	return emit(value & 0xFF) && emit(value >> 8);
+}
+
+
+// RuleVm::push / pop ***********************************************
+// ******************************************************************
+//
+bool RuleVm::push(int16_t value)
+{
+	if( mSp >= RULE_STACK_SIZE )
+	{
+		mIsFaulty = true;
+		return false;
+	}
+	mStack[mSp++] = value;
+	return true;
+}
+
+
+int16_t RuleVm::pop()
+{
+	if( !mSp )
+	{
+		mIsFaulty = true;
+		return 0;
+	}
+	return mStack[--mSp];
+}
+
+
+// RuleVm::run ******************************************************
+// ******************************************************************
+// an empty program is a complete run of its own. The shifts and the
+// states of the rules a reload dropped are taken back that way
+//
+bool RuleVm::run()
+{
+	if( mPc == 0 )
+	{
+		// a new run, nothing is shifted or forced until a rule says so
+
+		memset(mShift, 0, sizeof(mShift));
+		memset(mState, Item::normal, sizeof(mState));
+		mSp = 0;
+		mIsFaulty = false;
+	}
+
+	if( !mSize )
+		return true;
+
+	for( uint8_t n = 0; n < RULE_BUDGET; n++ )
+	{
+		// the operands of an instruction are read without checks, mCode
+		// is padded for the longest one (op_shift has 3 of them)
+
+		if( mPc >= mSize || mIsFaulty )
+		{
+			mIsFaulty = true;
+			mPc = 0;
+			return false;
+		}
+
+		uint8_t op = mCode[mPc++];
+		int16_t a, b;
+		uint8_t ch;
+
+		switch( op )
+		{
+		case op_end:
+			mPc = 0;
+			return !mIsFaulty;
+
+		case op_temp:
+			ch = mCode[mPc++];
+			push(ch < CHANNEL_COUNT ? Store.getTemperature(ch) : 0);
+			break;
+
+		case op_const:
+			a = mCode[mPc] | (mCode[mPc + 1] << 8);
+			mPc += 2;
+			push(a);
+			break;
+
+		case op_time:
+			push(mMinutes);
+			break;
+
+		case op_lt:
+		case op_gt:
+		case op_and:
+		case op_or:
+			b = pop();
+			a = pop();
+
+			if( op == op_lt )
+				push(a < b);
+			else if( op == op_gt )
+				push(a > b);
+			else if( op == op_and )
+				push(a && b);
+			else
+				push(a || b);
+			break;
+
+		case op_not:
+			push(!pop());
+			break;
+
+		case op_jz:
+			a = mCode[mPc++];
+			if( !pop() )
+				mPc += a;
+			break;
+
+		case op_shift:
+			ch = mCode[mPc];
+			a = mCode[mPc + 1] | (mCode[mPc + 2] << 8);
+			mPc += 3;
+
+			if( ch < CHANNEL_COUNT )
+				mShift[ch] += a;
+			break;
+
+		case op_on:
+		case op_off:
+			ch = mCode[mPc++];
+
+			if( ch < CHANNEL_COUNT )
+				mState[ch] = op == op_on ? Item::forced_on : Item::forced_off;
+			break;
+
+		default:
+			mIsFaulty = true;
+		}
+	}
+	return false;
+}
+
+
+// RuleVm::setProgram **********************************************
+// ******************************************************************
+//
+bool RuleVm::setProgram(const uint8_t * code, uint8_t size)
+{
+	clear();
+
+	if( size > RULE_CODE_SIZE || (size && code[size - 1] != op_end) )
+		return false;
+
+	memcpy( mCode, code, size );
+	mSize = size;
+	return true;
+}
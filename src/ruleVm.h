@@ -0,0 +1,153 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Control rule interpreter
+ *
+ * Created on: 		2016-10-15
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef RULEVM_H_
+#define RULEVM_H_
+
+#include <Arduino.h>
+#include "shield.h"
+#include "configReader.h"
+
+#define RULE_CODE_SIZE		128		// bytes of bytecode, all the rules together
+#define RULE_STACK_SIZE		8
+#define RULE_BUDGET			16		// instructions per loop pass
+#define RULE_VALUE_MAX		327		// C, the 1/100 C of it fits int16
+
+/*! @brief Runs the control rules of config.txt.
+ *
+ * The rules adjust the hysteresis of the channels depending on the other
+ * channels and the time of day:
+ *
+ *   RULE [NOT] <cond> [AND [NOT] <cond> ...] THEN <action>
+ *
+ *   cond:   T<x> < <v>         the temperature of channel x is below v (C)
+ *           T<x> > <v>         ... above v
+ *           TIME hh:mm-hh:mm   the time of day is within the window, may wrap midnight
+ *
+ *   action: SHIFT CH<x> <+|-><v>   move the thresholds of channel x by v (C)
+ *           ON CH<x>               channel x wants its actuators on
+ *           OFF CH<x>              channel x wants its actuators off
+ *
+ *   v is in whole C, -RULE_VALUE_MAX...RULE_VALUE_MAX. hh is 00...23, mm 00...59
+ *
+ * Each line is compiled when the configuration is loaded into a few bytes of
+ * stack machine code, appended to one program. The program is run over and
+ * over, at most RULE_BUDGET instructions per loop pass, so the loop takes the
+ * same time however many rules there are. The actions of a run are collected
+ * and only handed over when the run is complete. The shifts of several rules
+ * for one channel add up, ON and OFF of the later rule win.
+ *
+ * The forced states set by the button take precedence over the rules.
+ */
+class RuleVm
+{
+public:
+
+	/*! @brief The instructions. The operands follow the opcode */
+	typedef enum OpCode {
+		op_end,				/*!< end of the program */
+		op_temp,			/*!< ch: push the temperature of the channel (1/100 C) */
+		op_const,			/*!< lo hi: push the constant */
+		op_time,			/*!< push the minute of the day */
+		op_lt,				/*!< pop b, a, push a < b */
+		op_gt,				/*!< pop b, a, push a > b */
+		op_not,				/*!< pop a, push !a */
+		op_and,				/*!< pop b, a, push a && b */
+		op_or,				/*!< pop b, a, push a || b */
+		op_jz,				/*!< off: pop a, skip off bytes if a is 0 */
+		op_shift,			/*!< ch lo hi: add to the threshold shift of the channel (1/100 C) */
+		op_on,				/*!< ch: the channel is on */
+		op_off,				/*!< ch: the channel is off */
+		OP_CODE_COUNT
+	} OpCode_t;
+
+public:
+	RuleVm();
+	virtual ~RuleVm() {};
+
+	/*!
+	 * @brief      Drops all the rules. Has to be called before the configuration is parsed
+	 */
+	void clear();
+
+	/*!
+	 * @brief      Compiles one RULE line and appends it to the program.
+	 * @param[in]  line the words of the line, RULE first
+	 * @param[out] at   the word in error
+	 * @return     config_rule on syntax errors, config_rules_full if the program is
+	 *             full. The program is left as it was
+	 */
+	ConfigStatus_t compile(const ConfigLine & line, uint8_t * at);
+
+	/*!
+	 * @brief      Runs the program for at most RULE_BUDGET instructions.
+	 *
+	 * Shall be called once per loop pass. Never blocks.
+	 *
+	 * @return     true when a run is complete, getShift and getState are valid
+	 *             until the next call. Always with no rules, nothing is shifted
+	 *             or forced then
+	 */
+	bool run();
+
+	/*!
+	 * @brief      Sets the time of day the TIME conditions compare with.
+	 * @param[in]  minutes minute of the day, 0...1439
+	 */
+	void setTime(int16_t minutes) { mMinutes = minutes; }
+
+	int16_t getShift(uint8_t channel) { return mShift[channel]; }	//!< in 1/100 C
+	uint8_t getState(uint8_t channel) { return mState[channel]; }	//!< one of Item::ItemState_t
+
+	bool isEmpty() { return mSize == 0; }
+
+	/*!
+	 * @brief      Copies the program out, to be saved
+	 * @param[out] code RULE_CODE_SIZE bytes
+	 * @return     bytes of the program
+	 */
+	uint8_t getProgram(uint8_t * code) { memcpy(code, mCode, mSize); return mSize; }
+
+	/*!
+	 * @brief      Takes a program saved by getProgram
+	 * @return     false if it is not valid, the program is left empty
+	 */
+	bool setProgram(const uint8_t * code, uint8_t size);
+
+private:
+
+	bool emit(uint8_t byte);
+	bool emitChannel(const char * token, uint8_t skip);
+	bool emitValue(const char * token);
+	static bool toValue(const char * token, int * value);
+	bool emitWord(int16_t value);
+	int16_t pop();
+	bool push(int16_t value);
+
+	uint8_t mCode[RULE_CODE_SIZE + 3];
+	uint8_t mSize;					//!< bytes in mCode, ending with op_end
+	bool mIsFull;					//!< an emit of the line being compiled did not fit
+
+	uint8_t mPc;					//!< the next instruction
+	int16_t mStack[RULE_STACK_SIZE];
+	uint8_t mSp;
+	bool mIsFaulty;					//!< the stack overflowed or a bad opcode, the run is dropped
+
+	int16_t mMinutes;
+
+	int16_t mShift[CHANNEL_COUNT];	//!< the actions of the current run
+	uint8_t mState[CHANNEL_COUNT];
+};
+
+
+#endif /* RULEVM_H_ */
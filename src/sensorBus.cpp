@@ -0,0 +1,137 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Sensor bus class
+ *
+ * Created on: 		2016-10-04
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+#include "Arduino.h"
+#include "sensorBus.h"
+#include "adcChannel.h"
+
+extern AdcChannel ADCs[CHANNEL_COUNT];
+
+
+SensorBus::SensorBus() : mBank(0), mSwitchTime(0), mInFlight(0), mLast(CHANNEL_COUNT - 1)
+{
+	memset( mPending, 0, sizeof(mPending) );
+}
+
+
+
+void SensorBus::begin()
+{
+#if MUX_WIDTH > 1
+	for( uint8_t s = 0; s < 3; s++ )
+	{
+		pinMode( MUX_S0_PIN + s, OUTPUT );
+	}
+	selectBank(0);
+#endif
+}
+
+
+
+void SensorBus::requestAll()
+{
+	memset( mPending, 0xFF, sizeof(mPending) );
+}
+
+
+
+bool SensorBus::isDue(uint8_t channel)
+{
+	return ADCs[channel].isActive() && ((mPending[channel >> 3] & (1 << (channel & 7))) || ADCs[channel].isDue());
+}
+
+
+
+void SensorBus::start(uint8_t channel)
+{
+	mPending[channel >> 3] &= ~(1 << (channel & 7));
+	ADCs[channel].startSampling();
+	mInFlight++;
+}
+
+
+
+void SensorBus::selectBank(uint8_t bank)
+{
+	for( uint8_t s = 0; s < 3; s++ )
+	{
+		digitalWrite( MUX_S0_PIN + s, (bank >> s) & 1 ? HIGH : LOW );
+	}
+	mBank = bank;
+	mSwitchTime = millis();
+}
+
+
+
+// SensorBus::poll **************************************************
+// ******************************************************************
+// advance the channels of the current cycle, or start a new cycle
+//
+int SensorBus::poll()
+{
+	uint8_t first = mBank * ADC_PIN_COUNT;
+
+	if( mInFlight )
+	{
+		// only one of the channels completing in the same pass is reported,
+		// the others stay in the converting step until the next pass
+
+		for( uint8_t i = first; i < first + ADC_PIN_COUNT; i++ )
+		{
+			if( ADCs[i].isSampling() && ADCs[i].advance() )
+			{
+				mInFlight--;
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	// round robin, starting after the channel the latest cycle started
+	// with, so that a due channel can not be starved by the ones in front of it
+
+	for( uint8_t k = 1; k <= CHANNEL_COUNT; k++ )
+	{
+		uint8_t i = (mLast + k) % CHANNEL_COUNT;
+
+		if( !isDue(i) )
+			continue;
+
+		uint8_t bank = i / ADC_PIN_COUNT;
+
+		if( bank != mBank )
+		{
+			selectBank(bank);			// and come back when the multiplexers settle
+			return -1;
+		}
+
+		if( millis() - mSwitchTime < MUX_SETTLE_MS )
+			return -1;
+
+		mLast = i;
+		start(i);
+
+#if MUX_WIDTH > 1
+		// the rest of the bank shares the settling of this cycle
+
+		first = bank * ADC_PIN_COUNT;
+
+		for( uint8_t j = first; j < first + ADC_PIN_COUNT; j++ )
+		{
+			if( j != i && isDue(j) )
+				start(j);
+		}
+#endif
+		break;
+	}
+	return -1;
+}
@@ -0,0 +1,77 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Sensor bus class
+ *
+ * Created on: 		2016-10-04
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef SENSORBUS_H_
+#define SENSORBUS_H_
+
+#include <Arduino.h>
+#include "shield.h"
+
+/*! @brief Schedules the sampling of all the ADC channels.
+ *
+ * Decides which channels go through the sampling cycle and advances them
+ * once per loop pass.
+ *
+ * Without the multiplexer (MUX_WIDTH 1) all the inputs share the LP filter of
+ * the shield, so one channel at a time is sampled, picked round robin among
+ * the due ones.
+ *
+ * With the multiplexer every ADC pin has its own filter behind the 4051. The
+ * bus switches to the bank of the first due channel, waits for the
+ * multiplexers once, and then takes every due channel of that bank along in
+ * the same cycle. The ADC engine converts them side by side. The next cycle
+ * goes to the next bank with due channels, so a scan of all the banks costs one
+ * switch per bank.
+ */
+class SensorBus
+{
+public:
+	SensorBus();
+	virtual ~SensorBus() {};
+
+	/*!
+	 * @brief      Configures the select lines. Has to be called in the setup by the owner
+	 */
+	void begin();
+
+	/*!
+	 * @brief      Makes every active channel due, e.g. after press and hold
+	 */
+	void requestAll();
+
+	/*!
+	 * @brief      Advances the sampling. Never blocks
+	 *
+	 * Shall be called once per loop pass.
+	 *
+	 * @return     The channel with a new reading, -1 if none completed in this pass
+	 */
+	int poll();
+
+private:
+
+	bool isDue(uint8_t channel);
+	void start(uint8_t channel);
+	void selectBank(uint8_t bank);
+
+	uint8_t mPending[CHANNEL_MASK_SZ];	//!< channels to be sampled regardless of their period
+
+	uint8_t mBank;						//!< the bank currently selected
+	unsigned long mSwitchTime;			//!< when the bank was selected (ms)
+
+	uint8_t mInFlight;					//!< number of channels in the sampling cycle
+	uint8_t mLast;						//!< the channel the latest cycle started with
+};
+
+
+#endif /* SENSORBUS_H_ */
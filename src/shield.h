@@ -0,0 +1,70 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Shield layout
+ *
+ * Created on: 		2016-10-04
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef SHIELD_H_
+#define SHIELD_H_
+
+#define ADC_PIN_COUNT	8		// A0...A7
+#define ACTUATOR_COUNT	8		// A8...A15
+
+// Every ADC pin may fan out through a CD74HCT4051 (doc/CD74HCT4051_D_16.bxl).
+// The select lines S0...S2 are common to all the multiplexers, so switching
+// selects a bank of ADC_PIN_COUNT sensors at once. Set MUX_WIDTH to the inputs
+// used on each multiplexer, 2 or 4, when the multiplexer board is fitted, 1 when
+// the sensors are wired to A0...A7 directly.
+//
+// Be careful, every channel costs some 120 bytes of RAM: the Item with its Rollup
+// (63 bytes, 79 without the multiplexer, the history is longer), the AdcChannel
+// (50) and 7 in the ActuatorBank and the RuleVm. On top of that 26 bytes of heap
+// with a filter, 21 in the PID mode and 10 of the ConfigBlob on the stack while
+// the configuration is loaded. All 8 inputs, 64 channels, do not fit the 8 KB
+// of the ATmega2560, see CHANNEL_RAM_BUDGET.
+
+#define MUX_WIDTH		1
+
+#define MUX_S0_PIN		30		// select lines, S1 and S2 are the next two pins
+#define MUX_SETTLE_MS	1		// the multiplexer itself settles in under a microsecond
+
+// Uncomment when the NTCs are pulled up by the AD5165 digital pot (doc/AD5165.pdf)
+// instead of fixed resistors. The channels are then auto-ranged, see AdcChannel::setPot
+
+//#define DPOT_FITTED
+#define DPOT_CS_PIN		11
+
+#if defined(DPOT_FITTED) && MUX_WIDTH > 1
+#error "the multiplexed banks are sampled side by side, one AD5165 per ADC pin would be needed"
+#endif
+
+// The SD card of the logger shield, on the software SPI. Change the chip select
+// to match your SD shield or module: Arduino Ethernet shield: pin 4, Adafruit
+// SD shields and modules: pin 10, Sparkfun SD shield: pin 8
+
+#define SD_CS_PIN		10
+#define SD_MOSI_PIN		11
+#define SD_MISO_PIN		12
+#define SD_SCK_PIN		13
+
+// the channel c is the pin A0 + c % ADC_PIN_COUNT in the bank c / ADC_PIN_COUNT.
+// Without the multiplexer there is just the bank 0
+
+#define CHANNEL_COUNT	(ADC_PIN_COUNT * MUX_WIDTH)
+#define CHANNEL_MASK_SZ	((CHANNEL_COUNT + 7) / 8)		// bytes in a bit mask of all the channels
+
+// the RAM the channels, the log queue and the ConfigBlob may take. The rest is for
+// the SD library, the serial ports, the LCD, the ADC rings, the other globals
+// and the stack. Checked at build time in storage.cpp
+
+#define CHANNEL_RAM_BUDGET	6144
+
+
+#endif /* SHIELD_H_ */
@@ -0,0 +1,137 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Wear leveled state ring class
+ *
+ * Created on: 		2016-10-25
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include "stateRing.h"
+
+
+StateRing::StateRing(uint16_t start, uint16_t end)
+{
+	mStart = start;
+	mCount = (end - start) / STATE_SLOT_SZ;
+	mSlot = mCount - 1;
+	mSequence = 0;
+	mWritePos = STATE_SLOT_SZ;
+	mIsDirty = false;
+	mChangedAt = 0;
+	memset(mStates, 0, sizeof(mStates));
+	memset(mSaved, 0, sizeof(mSaved));
+}
+
+
+// StateRing::crcOf *************************************************
+// ******************************************************************
+//
+uint16_t StateRing::crcOf(const uint8_t * p, uint8_t len)
+{
+	uint16_t crc = 0xFFFF;
+
+	while( len-- )
+		crc = _crc16_update(crc, *p++);
+	return crc;
+}
+
+
+// StateRing::begin *************************************************
+// ******************************************************************
+// the sequence numbers in the ring are at most mCount apart, so the
+// difference tells the newer one even across the wrap around
+//
+bool StateRing::begin()
+{
+	bool isFound = false;
+
+	for( uint16_t slot = 0; slot < mCount; slot++ )
+	{
+		eeprom_read_block( mBuf, (const void *)address(slot), STATE_SLOT_SZ );
+
+		uint16_t crc = mBuf[STATE_SLOT_SZ - 2] | (mBuf[STATE_SLOT_SZ - 1] << 8);
+
+		if( crc != crcOf(mBuf, STATE_SLOT_SZ - 2) )
+			continue;
+
+		uint16_t sequence = mBuf[0] | (mBuf[1] << 8);
+
+		if( !isFound || (int16_t)(sequence - mSequence) > 0 )
+		{
+			isFound = true;
+			mSlot = slot;
+			mSequence = sequence;
+			memcpy( mStates, mBuf + 2, STATE_DATA_SZ );
+		}
+	}
+
+	memcpy( mSaved, mStates, STATE_DATA_SZ );
+	return isFound;
+}
+
+
+// StateRing::set ***************************************************
+// ******************************************************************
+//
+void StateRing::set(uint8_t item, uint8_t state)
+{
+	uint8_t shift = (item & 3) * 2;
+	uint8_t b = (mStates[item >> 2] & ~(3 << shift)) | ((state & 3) << shift);
+
+	if( b == mStates[item >> 2] )
+		return;
+
+	mStates[item >> 2] = b;
+	mIsDirty = true;
+	mChangedAt = millis();
+}
+
+
+// StateRing::service ***********************************************
+// ******************************************************************
+//
+void StateRing::service()
+{
+	if( mWritePos < STATE_SLOT_SZ )
+	{
+		if( !eeprom_is_ready() )
+			return;
+
+		uint16_t next = mSlot + 1 == mCount ? 0 : mSlot + 1;
+
+		eeprom_update_byte( (uint8_t *)(address(next) + mWritePos), mBuf[mWritePos] );
+
+		if( ++mWritePos == STATE_SLOT_SZ )
+			mSlot = next;		// complete, the CRC is the last byte
+		return;
+	}
+
+	if( !mIsDirty || millis() - mChangedAt < STATE_SETTLE_MS )
+		return;
+
+	mIsDirty = false;
+
+	// back to what is saved, nothing to write
+
+	if( !memcmp( mStates, mSaved, STATE_DATA_SZ ) )
+		return;
+
+	mSequence++;
+	mBuf[0] = mSequence & 0xFF;
+	mBuf[1] = mSequence >> 8;
+	memcpy( mBuf + 2, mStates, STATE_DATA_SZ );
+
+	uint16_t crc = crcOf(mBuf, STATE_SLOT_SZ - 2);
+	mBuf[STATE_SLOT_SZ - 2] = crc & 0xFF;
+	mBuf[STATE_SLOT_SZ - 1] = crc >> 8;
+
+	memcpy( mSaved, mStates, STATE_DATA_SZ );
+	mWritePos = 0;
+}
@@ -0,0 +1,96 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Wear leveled state ring class
+ *
+ * Created on: 		2016-10-25
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#ifndef STATERING_H_
+#define STATERING_H_
+
+#include <Arduino.h>
+#include "shield.h"
+
+#define STATE_DATA_SZ		((CHANNEL_COUNT + 3) / 4)		// 2 bits per item
+#define STATE_SLOT_SZ		(2 + STATE_DATA_SZ + 2)		// sequence, states, CRC
+#define STATE_SETTLE_MS		5000		// the button cycles through the states, only the last one is saved
+
+/*! @brief Keeps the forced states of the items in EEPROM, wear leveled.
+ *
+ * The area is a ring of slots. Each slot is a snapshot of all the states
+ * with a sequence number and a CRC. A change goes to the slot after the
+ * latest one, so every slot is written once per round. With 8 items the
+ * 3 KB above the configuration hold 512 slots, so a cell sees a write every
+ * 512 changes.
+ *
+ * At boot the valid slot with the highest sequence number is the latest.
+ * A reset while a slot is written leaves it with a bad CRC, the one before
+ * it is taken.
+ *
+ * set() only changes RAM. The slot is written by service(), a byte per call
+ * and only when the EEPROM is ready, so the ~3.3 ms a byte takes are never
+ * waited for. The changes are collected for STATE_SETTLE_MS first. A slot
+ * is only written if the states differ from the latest one.
+ */
+class StateRing
+{
+public:
+	/*!
+	 * @param[in]  start the first EEPROM address of the ring
+	 * @param[in]  end   the address after the ring
+	 */
+	StateRing(uint16_t start, uint16_t end);
+	virtual ~StateRing() {};
+
+	/*!
+	 * @brief      Finds the latest slot and takes the states from it
+	 * @return     false if there is none, all the states are 0
+	 */
+	bool begin();
+
+	uint8_t get(uint8_t item) { return (mStates[item >> 2] >> ((item & 3) * 2)) & 3; }
+
+	/*!
+	 * @brief      Changes the state in RAM. Saved later by service
+	 * @param[in]  state 0...3
+	 */
+	void set(uint8_t item, uint8_t state);
+
+	/*!
+	 * @brief      Writes the pending states, a byte at a time. Never waits
+	 *
+	 * Shall be called once per loop pass.
+	 */
+	void service();
+
+	bool isPending() { return mIsDirty || mWritePos < STATE_SLOT_SZ; }	//!< not all on EEPROM yet
+
+private:
+
+	uint16_t address(uint16_t slot) { return mStart + slot * STATE_SLOT_SZ; }
+	static uint16_t crcOf(const uint8_t * p, uint8_t len);
+
+	uint16_t mStart;
+	uint16_t mCount;					//!< slots in the ring
+
+	uint8_t mStates[STATE_DATA_SZ];		//!< the current ones
+	uint8_t mSaved[STATE_DATA_SZ];		//!< the ones in the latest slot
+
+	uint16_t mSlot;						//!< the latest complete slot
+	uint16_t mSequence;					//!< of the latest slot
+
+	uint8_t mBuf[STATE_SLOT_SZ];		//!< the slot being written
+	uint8_t mWritePos;					//!< the next byte of mBuf to write, STATE_SLOT_SZ if none
+
+	bool mIsDirty;
+	unsigned long mChangedAt;			//!< millis() of the latest change
+};
+
+
+#endif /* STATERING_H_ */
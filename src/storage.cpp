@@ -12,25 +12,47 @@
  */
 
 #include <SD.h>
-#include <EEPROM.h>
+#include <avr/eeprom.h>
 #include <avr/pgmspace.h>
+#include <util/crc16.h>
+#include <util/atomic.h>
 #include "storage.h"
 #include <string.h>
 #include "actuator.h"
 #include "adcChannel.h"
+#include "ruleVm.h"
+#include "actuatorBank.h"
+#include "logRecord.h"
 
 const char configFileHeader[] PROGMEM = {
 "******************************************************************************\r\n\
 * This is the configuration file config.txt. All the lines, not\r\n\
-* starting with \"CH\" are ignored by the parser. The parser is not very\r\n\
-* intelligent. So be careful with the format.\r\n\
+* starting with \"CH\", \"A\" or \"RULE\" are ignored by the parser. The\r\n\
+* first error stops it, its line and column go to the debugging port.\r\n\
 *\r\n\
 * The following format applies:\r\n\
-*  CH<x> <[C+|C-]<v>> <L:{ON|OFF}> [<TempLow> <TempHigh> [A:<y1> [y2 [y3 ...]]]]\r\n\
+*  CH<x> <[C+|C-]<v>> [M:<mode>] [S:<sensor>] [P:<period>] [F:<filter>] <L:{ON|OFF}>\r\n\
+*      [<TempLow> <TempHigh> [A:<y1> [y2 [y3 ...]]]]\r\n\
 * \r\n\
 *  where <C+v|C-v> 	is calibration value in one tenth of centigrade unit\r\n\
+*		 <M:>		is the control mode, HYS (default), TP or PID:\r\n\
+*		            HYS  on below TempLow, off above TempHigh\r\n\
+*		            TP   duty cycle 100% at TempLow down to 0% at TempHigh\r\n\
+*		            PID  duty cycle from PID around the middle of the limits\r\n\
+*		            The duty cycle runs the actuators in 4 minute windows\r\n\
+*		 <S:>		is the thermistor, MF52 (10K B3435, default), B57861 (5K B3988),\r\n\
+*		            MF58 (100K B3950) or given by its parameters:\r\n\
+*		            <R0>/<B>          R0 at 25C and B, e.g. S:10000/3950\r\n\
+*		            <R>/<A>/<B>/<C>   Steinhart-Hart, R is the pull-up resistor,\r\n\
+*		                              e.g. S:10000/1.129e-3/2.341e-4/8.775e-8\r\n\
+*		            (at most 4 different ones given by their parameters)\r\n\
+*		 <P:>		is the sampling period in seconds, <s> or <min>-<max> (default\r\n\
+*		            5-60). The closer to a limit, the closer to min\r\n\
+*		 <F:>		is the filter of the readings: NONE (default), AVG4, AVG8 (moving\r\n\
+*		            averages), EMA (exponential), MED3, MED5 (medians, against spikes)\r\n\
 *		 <L:>		is whether logging is enabled\r\n\
 *		 <x>        is the value 1 to 8, corresponding to ADC channels\r\n\
+*		            (1 to 64 with the multiplexer board, CH9 is bank 2 on T-1)\r\n\
 *        <TempLow>  is the lower temperature limit in C, e.g. 20 \r\n\
 *        <TempHigh> is the higher temperature limit in C, e.g. 22\r\n\
 *        <y>        is the actuator that is affected by this ADC\r\n\
@@ -38,34 +60,146 @@ const char configFileHeader[] PROGMEM = {
 * Example: ADC T-4 controls OUT 4, 5 and 6. Calibration correction +0.4C\r\n\
 *  CH4 C+4 L:ON 20 22 A:4 5 6 \r\n\
 * \r\n\
+* Example: ADC T-2 holds 21C with PID on OUT 2\r\n\
+*  CH2 C+0 M:PID L:ON 20 22 A:2\r\n\
+* \r\n\
+* Example: ADC T-6 has a 100K B3950 NTC, sampled every 10 to 30s, spikes removed\r\n\
+*  CH6 C+0 S:100000/3950 P:10-30 F:MED3 L:ON 18 20 A:6\r\n\
+* \r\n\
 * Example: ADC T-3 is logging only\r\n\
 *  CH3 C+0 L:ON\r\n\
 * \r\n\
 * Example: ADC T-5 is inactive. It will be skipped in the LCD\r\n\
 *  CH5 C+0 L:OFF\r\n\
 * \r\n\
+* The lines starting with \"A\" set how the channels driving an actuator\r\n\
+* combine:\r\n\
+*  A<y> <OR|AND|MAJ> [P:<x>]\r\n\
+* \r\n\
+*  where OR         on if any of the channels is on (default)\r\n\
+*        AND        on if all of the channels are on\r\n\
+*        MAJ        on if more than half of the channels are on\r\n\
+*        <P:x>      channel x turns the actuator on whatever the others say\r\n\
+*                   (at most 8 channels per actuator)\r\n\
+* \r\n\
+* Example: OUT 2 heats two rooms, runs until both are warm. T-8 outside\r\n\
+*          forces it on when it is very cold\r\n\
+*  A2 AND P:8\r\n\
+* \r\n\
+* The lines starting with \"RULE\" adjust the channels, in the order given:\r\n\
+*  RULE [NOT] <cond> [AND [NOT] <cond> ...] THEN <action>\r\n\
+* \r\n\
+*  where <cond>     is T<x> < <v>, T<x> > <v> (temperature of channel x in C)\r\n\
+*                   or TIME hh:mm-hh:mm\r\n\
+*        <action>   is SHIFT CH<x> <+|-><v> (move the limits of x by v C),\r\n\
+*                   ON CH<x> or OFF CH<x>\r\n\
+* \r\n\
+* Example: 2C warmer in room T-1 when it is below -10C outside (T-8)\r\n\
+*  RULE T8 < -10 THEN SHIFT CH1 +2\r\n\
+* \r\n\
+* Example: T-3 only heats between 06:00 and 22:00\r\n\
+*  RULE NOT TIME 06:00-22:00 THEN OFF CH3\r\n\
+* \r\n\
 * Notice, the CHx line removed from the file would mean default configuration\r\n\
 * for this channel, and not that it is inactive\r\n\
 *\r\n\
+* The changes to this file are taken within a few minutes, or at once when\r\n\
+* R is sent to the debugging port. No reset is needed. A file with errors is\r\n\
+* not taken, the previous configuration stays.\r\n\
+*\r\n\
 * If you screwed up the configuration, just remove this file. The default\r\n\
 * configuration will be created when the SD card is inserted and reset is done.\r\n\
 *******************************************************************************\r\n\r\n"};
 
-// change this to match your SD shield or module;
-// Arduino Ethernet shield: pin 4
-// Adafruit SD shields and modules: pin 10
-// Sparkfun SD shield: pin 8
-const int chipSelect = 10;
-
 File cfgFile;
 
-extern Actuator Actuators[8];
-extern AdcChannel ADCs[8];
+extern Actuator Actuators[ACTUATOR_COUNT];
+extern AdcChannel ADCs[CHANNEL_COUNT];
+extern RuleVm Rules;
+extern ActuatorBank Bank;
 
 static const int LOGGING_INTERVAL = 3600;		// seconds
 
-static const byte MAGIC_EEPROM_BYTE1 = 0x01;	// version
-static const byte MAGIC_EEPROM_BYTE2 = 0x05;	// revision
+/*! @brief The checkpoint of the journal, followed by a ChannelCheckpoint per
+ *  item, an ActuatorCheckpoint per actuator and the pending records
+ */
+struct Checkpoint
+{
+	uint8_t mChannels;			//!< CHANNEL_COUNT of the firmware that wrote it
+	long mLastLog;
+	uint32_t mElapsed;			//!< ms of the logging period so far
+	uint16_t mMonth;			//!< year * 12 + month - 1 of the pending records
+	uint32_t mFileSize;			//!< of the file of the month, when the pending records were taken
+	uint16_t mPending;			//!< bytes of records not on the card
+} __attribute__((packed));
+
+struct ChannelCheckpoint
+{
+	uint32_t mOnTime;
+	uint16_t mToggles;
+	uint16_t mMin;				//!< the rollup of the period, in readings
+	uint16_t mMax;
+	uint32_t mSum;
+	uint16_t mCount;
+} __attribute__((packed));
+
+struct ActuatorCheckpoint
+{
+	uint32_t mOnTime;
+	uint16_t mToggles;
+} __attribute__((packed));
+
+typedef char CheckpointSizeCheck[sizeof(JournalHeader) + sizeof(Checkpoint) + CHANNEL_COUNT * sizeof(ChannelCheckpoint)
+		+ ACTUATOR_COUNT * sizeof(ActuatorCheckpoint) + LOG_SECTOR_SZ <= JOURNAL_SLOT_SZ ? 1 : -1];
+
+static const uint8_t CONFIG_BLOB_VERSION = 0x03;
+static const uint8_t CONFIG_BLOB_REVISION = MUX_WIDTH > 1 ? 0x18 : 0x08;	// the layout depends on CHANNEL_COUNT
+
+/*! @brief The head of the configuration in EEPROM */
+struct ConfigBlobHeader
+{
+	uint8_t mVersion;			//!< CONFIG_BLOB_VERSION
+	uint8_t mRevision;			//!< CONFIG_BLOB_REVISION
+	uint16_t mLength;			//!< sizeof(ConfigBlob)
+	uint32_t mSourceHash;		//!< CRC-32 of the config.txt it was parsed from, 0 if none
+} __attribute__((packed));
+
+/*! @brief The configuration of an item, as kept in EEPROM */
+struct ItemConfig
+{
+	int8_t mLow;
+	int8_t mHigh;
+	uint8_t mActuators;
+	uint8_t mIsLogging;
+	int8_t mCalibration;		//!< one tenth of centigrade
+	uint8_t mMode;
+	uint8_t mSensor;			//!< one of NtcType_t, or NTC_TYPE_COUNT + the index in ConfigBlob::mSensors
+	uint8_t mFilter;			//!< one of FilterType_t
+	uint8_t mPeriodMin;			//!< the bounds of the sampling period (s)
+	uint8_t mPeriodMax;
+} __attribute__((packed));
+
+/*! @brief The parsed configuration, saved as it is at EEPROM_CONFIG_ADDR and
+ *  followed by the CRC-16 of its bytes
+ */
+struct ConfigBlob
+{
+	ConfigBlobHeader mHeader;
+	ItemConfig mItems[CHANNEL_COUNT];
+	uint8_t mRules[ACTUATOR_COUNT];
+	uint8_t mPriority[ACTUATOR_COUNT];
+	uint8_t mProgramSize;
+	uint8_t mProgram[RULE_CODE_SIZE];
+	uint8_t mSensorCount;
+	NtcParams mSensors[NTC_CUSTOM_COUNT];	//!< the sensors given by their parameters
+} __attribute__((packed));
+
+typedef char ConfigBlobSizeCheck[EEPROM_CONFIG_ADDR + sizeof(ConfigBlob) + 2 <= EEPROM_STATE_ADDR ? 1 : -1];
+
+// the channels in ActuatorBank and RuleVm are the 7 bytes, see shield.h
+
+typedef char ChannelRamCheck[CHANNEL_COUNT * (sizeof(Item) + sizeof(AdcChannel) + 7)
+		+ LOG_QUEUE_SECTORS * LOG_SECTOR_SZ + sizeof(ConfigBlob) <= CHANNEL_RAM_BUDGET ? 1 : -1];
 
 
 // freeRam **********************************************************
@@ -81,30 +215,67 @@ int freeRam () {
 }
 
 
-Storage::Storage()
+Storage::Storage() : mStates(EEPROM_STATE_ADDR, EEPROM_STATE_END)
 {
 	mIndex = 0;
 	mSDInserted = false;
 	mLastLog = 0;
 	mIsAnyActiveChannel = false;
-	mCheckPointsTotal = 0;
+	mIntervalStart = 0;
+	mLastCheckpoint = 0;
+	mIsCheckpointDue = false;
+	mJournalRetry = 0;
+	mCheckpointStep = checkpoint_idle;
+	mCheckpointPos = 0;
+	mCheckpointAt = 0;
+	mCheckpointLog = 0;
+	mPending = 0;
+	mPendingLength = 0;
+	mPendingMonth = 0;
+	mPendingFileSize = 0;
+	mConfigHash = 0;
+	mConfigSize = 0;
+	mConfigPolls = 0;
+	mConfigError.mStatus = config_ok;
+	mConfigError.mLine = 0;
+	mConfigError.mColumn = 0;
+	memset(mDemand, 0, sizeof(mDemand));
+
+	for( int i = 0; i < ACTUATOR_COUNT; i++ )
+	{
+		mRules[i] = Actuator::combine_or;
+		mPriority[i] = NO_CHANNEL;
+	}
+
+	for( int k = 0; k < NTC_CUSTOM_COUNT; k++ )
+		mSensorKnots[k] = NULL;
 
 	Item defaultItem;
 	defaultItem.Temperature = 0;
+	defaultItem.mReading = 0;
+	defaultItem.mIsConverted = true;
+	defaultItem.mOnReading = NTC_READING_END;
+	defaultItem.mOffReading = 0;
 	defaultItem.mHigh = 22;
 	defaultItem.mLow = 20;
 	defaultItem.mIsDirty = true;
-	defaultItem.mIsOn = true;
+	defaultItem.mIsOn = false;
 	defaultItem.mItemState = Item::normal;
 	defaultItem.mIsLogging = true;
-	defaultItem.mCheckPointsActive = 0;
+	defaultItem.mOnTime = 0;
+	defaultItem.mOnSince = 0;
 	defaultItem.mToggleCounter = 0;
 	defaultItem.mCalibrationValue = 0;
+	defaultItem.mShift = 0;
+	defaultItem.mRuleState = Item::normal;
+	defaultItem.mMode = control_hysteresis;
+	defaultItem.mPid = NULL;
+	defaultItem.mDuty = 0;
 
 
 	for( int i = 0; i < CHANNEL_COUNT; i++ )
 	{
-		defaultItem.mActuators = 1 << i;
+		defaultItem.mActuators = i < ACTUATOR_COUNT ? 1 << i : 0;
 		mItems[i] = defaultItem;
 	}
 }
@@ -121,18 +292,16 @@ bool Storage::begin()
 	Serial1.println( freeRam() );
 
 	bool isSD = false;
-	bool cfgFileExists = false;
+	bool isNew = false;			// the items do not come from EEPROM, to be saved
+	uint32_t hash = 0;			// of the config.txt the items come from
 
-	byte mb1 = EEPROM.read( 0 );		// version
-	byte mb2 = EEPROM.read( 1 );		// revision
+	ConfigBlob blob;			// what the items will take
+	defaultConfig( blob );
 
-	char s[32];
-	sprintf( s, "EEPROM Magic Byte 1 = %02X", mb1 );
-	Serial1.println( s );
-	sprintf( s, "EEPROM Magic Byte 2 = %02X", mb2 );
-	Serial1.println( s );
+	uint32_t savedHash;
+	bool isValidConfigEEPROM = checkConfig( &savedHash );
 
-	bool isValidConfigEEPROM = (mb1 == MAGIC_EEPROM_BYTE1 && mb2 == MAGIC_EEPROM_BYTE2);
+	Rules.clear();
 
 	if( isValidConfigEEPROM )
 	{
@@ -153,7 +322,7 @@ bool Storage::begin()
 	pinMode(SS, OUTPUT);
 
 
-	if ( !SD.begin(chipSelect, 11, 12, 13) )
+	if ( !SD.begin(SD_CS_PIN, SD_MOSI_PIN, SD_MISO_PIN, SD_SCK_PIN) )
 	{
 		Serial1.println("SD card not found. EEPROM configuration will be used");
 	}
@@ -161,181 +330,106 @@ bool Storage::begin()
 	{
 		isSD = true;			// the SD card is at least inserted
 
-		Serial1.println( "Populating Items from SD-card" );
-
-		// open the file. note that only one file can be open at a time,
-		// so you have to close this one before opening another.
-
-		// check if the file exists.
+		mLog.begin();
 
-		cfgFileExists = SD.exists("config.txt");
-
-		if( cfgFileExists )
+		if( SD.exists("config.txt") )
 		{
 			Serial1.println( "config.txt found" );
 
 			cfgFile = SD.open("config.txt");
 
-			if ( cfgFile && cfgFile.available() )
+			if ( !cfgFile )
+			{
+				// if the file didn't open, someone probably removed the SD card.
+				// It is an error situation. Raise an alarm
+				mConfigError.mStatus = config_read;
+			}
+			else
 			{
-				Serial1.println("config.txt:");
+				// the file the EEPROM was saved from is not parsed again
 
-				char buf[128];
-				char * bufPtr = buf;
+				hash = hashFile( cfgFile );
+				mConfigSize = cfgFile.size();
 
-				// read from the file until there's nothing else in it:
-				do
+				if( isValidConfigEEPROM && hash == savedHash )
 				{
-					int c = cfgFile.read();
-
-					if(c == '\r')
-						continue;
-
-					if(c == '\n' || !cfgFile.available() /*EOF*/)
-					{
-						if( !cfgFile.available() )
-						{
-							Serial1.println( "EOF" );
-							*bufPtr++ = c;
-						}
-
-						*bufPtr = 0;
-						bufPtr = buf;
-
-					    Serial1.println( buf );
-
-						if( memcmp( buf, "CH", 2 ) )		// ignore all lines not starting with "CH"
-							continue;
-
-						if( parseln( buf ) == false )
-						{
-							return false;
-						}
-					}
-					else
-					{
-						*bufPtr++ = c;
-					}
-
-				} while ( cfgFile.available() );
+					Serial1.println( "config.txt unchanged, parsing skipped" );
+				}
+				else
+				{
+					Serial1.println( "Populating Items from SD-card" );
 
-				// close the file:
+					cfgFile.seek( 0 );
+					parseConfig( cfgFile, blob );
+					isNew = true;
+				}
 				cfgFile.close();
 			}
-			else
-			{
-				// if the file didn't open, print an error. Someone probably
-				// removed the SD card. It is an error situation. Raise an alarm
-				Serial1.println("error opening config.txt for reading");
-				return false;
-			}
 		}
 		else
 		{
+			// if the SD card is in but the config file is not found, the default
+			// file will be generated and stored on the SD card (and in EEPROM)
+
 			Serial1.println( "config.txt does not exist" );
+
+			hash = createConfig();
+			isNew = true;
 		}
 	}
 
-	// if reading SD configuration fails, the second alternative will be populating Items from EEPROM.
-	// The item state is only stored in EEPROM. So read it in for valid EEPROM configurations
+	bool isBad = mConfigError.mStatus != config_ok;
 
-	if( isValidConfigEEPROM )
+	if( isBad )
 	{
-		if( isSD == false )
-			Serial1.println( "Populating Items from EEPROM" );
+		// the file is not taken, nor saved. Meanwhile the configuration
+		// in EEPROM, or else the defaults. reloadConfig takes the file
+		// once it is corrected, its hash tells
 
-		byte ptr = 2;				// skip the first two bytes (version, revision)
+		Serial1.println( "config.txt not taken, EEPROM configuration or defaults used" );
 
-		for( byte i = 0; i < CHANNEL_COUNT; i++ )
-		{
-			if( isSD == false )
-			{
-				mItems[i].mLow = (int)EEPROM.read( ptr );
-				mItems[i].mHigh = (int)EEPROM.read( ptr + 1 );
-				mItems[i].mActuators = EEPROM.read( ptr + 2 );
-				mItems[i].mIsLogging = EEPROM.read( ptr + 3 );
-				mItems[i].mCalibrationValue = (float)(EEPROM.read( ptr + 4 )) / 10.0;
-			}
-
-			// the forced state of the item is only stored in EEPROM and
-			// shall always be read from it
-			mItems[i].mItemState = static_cast<Item::ItemState_t>(EEPROM.read( ptr + 5 ));
+		Rules.clear();
+		defaultConfig( blob );
 
-			ptr += EEPROM_ITEM_SZ;				// move to the next record
-		}
+		if( isValidConfigEEPROM )
+			loadConfig( blob );
 	}
-
-	// now write down the whatever configuration to EEPROM and to SD card (if possible)
-
-	cfgFile = SD.open("config.txt", FILE_WRITE);
-
-	if (cfgFile)
+	else if( !isNew && isValidConfigEEPROM )
 	{
-		// if the SD card is in, but there is no config file, create it
+		if( isSD == false )
+			Serial1.println( "Populating Items from EEPROM" );
 
-		if( isSD == true && !cfgFileExists )
-		{
-			// if the SD card is in but the config file is not found, the default
-			// file will be generated and stored on the SD card (and in EEPROM)
+		loadConfig( blob );
+	}
+	else
+	{
+		// only written when it changed, or to get a valid one
 
-			Serial1.println("config.txt: creating default configuration");
+		blob.mProgramSize = Rules.getProgram( blob.mProgram );
+		saveConfig( blob, hash );
+	}
 
-			// insert the header
+	applyConfig( blob );
 
-			int len = strlen_P( configFileHeader );
-			for (int k = 0; k < len; k++)
-			{
-				cfgFile.print( static_cast<char>(pgm_read_byte_near( configFileHeader + k ) ) );
-			}
+	mSDInserted = isSD;
+	mConfigHash = hash;
 
-			for( int i = 0; i < CHANNEL_COUNT; i++ )
-			{
-				char buf[128];
-				sprintf(buf, "CH%d C+0 L:%s %d %d A:", i+1, mItems[i].mIsLogging ? "ON" : "OFF", mItems[i].mLow, mItems[i].mHigh );
-				cfgFile.print(buf);
+	// the forced state of the item is only stored in EEPROM and
+	// shall always be read from it. Not part of the configuration
 
-				for( int k = 0; k < CHANNEL_COUNT; k++ )
-				{
-					if( mItems[i].mActuators & (1 << k) )
-					{
-						cfgFile.print( ' ' );
-						cfgFile.print( (char)(k + '1') );
-					}
-				}
-				cfgFile.println();
-			}
+	if( !mStates.begin() )
+		Serial1.println( "No forced states in EEPROM" );
 
-			// close the file:
-			cfgFile.close();
-			Serial1.println("done.");
-		}
-	}
-	else
+	for( byte i = 0; i < CHANNEL_COUNT; i++ )
 	{
-		// if the file didn't open, print an error:
-		Serial1.println("error opening config.txt for writing");
+		uint8_t state = mStates.get( i );
+		mItems[i].mItemState = state <= Item::forced_on ? static_cast<Item::ItemState_t>(state) : Item::normal;
 	}
 
-	// store to EEPROM
-
-	byte ptr = 0;
-	EEPROM.write( ptr++, MAGIC_EEPROM_BYTE1 );
-	EEPROM.write( ptr++, MAGIC_EEPROM_BYTE2 );
-
 	char b[128];
 
 	for( byte i = 0; i < CHANNEL_COUNT; i++ )
 	{
-		EEPROM.write( ptr++, mItems[i].mLow);
-		EEPROM.write( ptr++, mItems[i].mHigh );
-		EEPROM.write( ptr++, mItems[i].mActuators );
-		EEPROM.write( ptr++, mItems[i].mIsLogging );
-		EEPROM.write( ptr++, (byte)(mItems[i].mCalibrationValue * 10));
-
-		if( !isValidConfigEEPROM )
-			EEPROM.write( ptr, mItems[i].mItemState );
-		ptr++;
-
 		sprintf( b, "mItems[%d].mLow=%d", i, mItems[i].mLow);
 		Serial1.println( b );
 		sprintf( b, "mItems[%d].mHigh=%d", i, mItems[i].mHigh);
@@ -346,325 +440,1530 @@ bool Storage::begin()
 		Serial1.println( b );
 		sprintf( b, "mItems[%d].mItemState=%d", i, mItems[i].mItemState );
 		Serial1.println( b );
-		sprintf( b, "Calibration Value=%d (in ten's of a centigrade)", (int)(mItems[i].mCalibrationValue * 10.0) );
+		sprintf( b, "Calibration Value=%d (in ten's of a centigrade)", mItems[i].mCalibrationValue / 10 );
+		Serial1.println( b );
+		sprintf( b, "mItems[%d].mMode=%d", i, mItems[i].mMode );
 		Serial1.println( b );
-		Serial1.println( mItems[i].mCalibrationValue );
+		sprintf( b, "Sampling period %lu-%lu ms", ADCs[i].getMinPeriod(), ADCs[i].getMaxPeriod() );
+		Serial1.println( b );
+	}
 
-		// activate the corresponding ADC
+	activateItems();
 
-		if ( mItems[i].mActuators || mItems[i].mIsLogging )
-		{
-			mIsAnyActiveChannel = true;
-			ADCs[i].activate();
-		}
-	}
-	return true;
+	// the logging period goes on where the latest checkpoint left it
+
+	if( isSD && mJournal.begin() )
+		replay();
+
+	return !isBad;
 }
 
 
-// Storage::parseln *************************************************
+// Storage::parseConfig *********************************************
 // ******************************************************************
+// stops at the first error, see getConfigError
 //
-bool Storage::parseln( const char * line )
+bool Storage::parseConfig( File & file, ConfigBlob & blob )
 {
-	char lBuf[128];
-	strcpy(lBuf, line);
+	ConfigReader reader( file );
+	ConfigLine line;
 
-	Serial1.print( freeRam() );
-	Serial1.println( " Bytes left" );
+	mConfigError.mStatus = config_ok;
 
-	int low, high;
-	uint8_t acts = 0;		// bit mask of the controlled actuators
+	while( mConfigError.mStatus == config_ok && reader.next( &line ) )
+	{
+		const char * first = line.token(0);
+		ConfigStatus_t status = config_ok;
+		uint8_t at = 0;
+
+		if( !first )
+			continue;
+
+		bool isChannel = !memcmp( first, "CH", 2 );
+		bool isActuator = first[0] == 'A' && isdigit(first[1]);
+		bool isRule = !strcmp( first, "RULE" );
 
-	char * ch = strstr(lBuf, "CH");
+		// ignore all the other lines
+
+		if( (isChannel || isActuator || isRule) && line.isTruncated() )
+		{
+			status = config_too_many;
+			at = CONFIG_MAX_TOKENS - 1;
+		}
+		else if( isChannel )
+			status = parseln( line, &at, blob );
+		else if( isActuator )
+			status = parseRule( line, &at, blob );
+		else if( isRule )
+			status = Rules.compile( line, &at );
+
+		if( status != config_ok )
+		{
+			mConfigError.mStatus = status;
+			mConfigError.mLine = reader.getLineNumber();
+			mConfigError.mColumn = line.column(at);
+		}
+	}
 
-	if(!ch)
+	if( mConfigError.mStatus == config_ok && reader.getStatus() != config_ok )
 	{
-		return true;
+		mConfigError.mStatus = reader.getStatus();
+		mConfigError.mLine = reader.getLineNumber();
+		mConfigError.mColumn = 1;
 	}
 
-	int chId = *(ch+2)-'1';
+	return mConfigError.mStatus == config_ok;
+}
+
+
+// Storage::createConfig ********************************************
+// ******************************************************************
+// the default items go to a new config.txt
+//
+uint32_t Storage::createConfig()
+{
+	cfgFile = SD.open("config.txt", FILE_WRITE);
 
-	if(chId < 0 || chId > 7)
+	if( !cfgFile )
 	{
-		Serial1.println("Channel ID out of range (1...8)");
-		return false;
+		Serial1.println("error opening config.txt for writing");
+		return 0;
 	}
 
-	Serial1.print("CH");
-	Serial1.print(chId+1);		// towards the user all the channels are counted 1 to 8
+	Serial1.println("config.txt: creating default configuration");
 
-	// calibration
+	// insert the header
 
-	if( strstr(line, "C+") )
+	int len = strlen_P( configFileHeader );
+	for (int k = 0; k < len; k++)
+	{
+		cfgFile.print( static_cast<char>(pgm_read_byte_near( configFileHeader + k ) ) );
+	}
+
+	for( int i = 0; i < CHANNEL_COUNT; i++ )
 	{
-		char buf[32];
-		strcpy( buf, strstr(line, "C+") + 2 );
-		const char * pch = strtok( buf, " " );
-		Serial1.print( " calibration = " );
+		char buf[128];
+		sprintf(buf, "CH%d C+0 L:%s %d %d A:", i+1, mItems[i].mIsLogging ? "ON" : "OFF", mItems[i].mLow, mItems[i].mHigh );
+		cfgFile.print(buf);
 
-		if(pch)
+		for( int k = 0; k < ACTUATOR_COUNT; k++ )
 		{
-			mItems[chId].mCalibrationValue = (float)atoi(pch) / 10.0;
-			Serial1.println( mItems[chId].mCalibrationValue );
+			if( mItems[i].mActuators & (1 << k) )
+			{
+				cfgFile.print( ' ' );
+				cfgFile.print( (char)(k + '1') );
+			}
 		}
+		cfgFile.println();
 	}
-	else
+
+	for( int k = 0; k < ACTUATOR_COUNT; k++ )
 	{
-		if( strstr(line, "C-") )
-		{
-			char buf[32];
-			strcpy( buf, strstr(line, "C-") + 2 );
-			const char * pch = strtok( buf, " " );
-			Serial1.print( " calibration = " );
+		cfgFile.print( 'A' );
+		cfgFile.print( k + 1 );
+		cfgFile.println( " OR" );
+	}
 
-			if(pch)
-			{
-				mItems[chId].mCalibrationValue = -(float)atoi(pch) / 10.0;
-				Serial1.println( mItems[chId].mCalibrationValue );
-			}
+	cfgFile.close();
+	Serial1.println("done.");
 
-		}
-		else
-		{
-			Serial1.println( " Missing calibration value" );
-			return false;
-		}
+	// the hash of what is on the card now, so that it is not parsed
+	// at the next boot
+
+	uint32_t hash = 0;
+	cfgFile = SD.open("config.txt");
+
+	if( cfgFile )
+	{
+		hash = hashFile( cfgFile );
+		cfgFile.close();
 	}
+	return hash;
+}
 
 
-	// look for L:ON|L:OFF
+// Storage::hashFile ************************************************
+// ******************************************************************
+// CRC-32 of the whole file, from where it is
+//
+uint32_t Storage::hashFile( File & file )
+{
+	uint8_t buf[64];
+	uint32_t crc = 0xFFFFFFFF;
+	int n;
 
-	if( strstr(line, "L:ON") )
-		mItems[chId].mIsLogging = true;
-	else
+	while( (n = file.read( buf, sizeof(buf) )) > 0 )
 	{
-		if( strstr(line, "L:OFF") )
-			mItems[chId].mIsLogging = false;
-		else
+		for( int i = 0; i < n; i++ )
 		{
-			Serial1.println( "Missing logging switch" );
-			return false;
+			crc ^= buf[i];
+
+			for( uint8_t k = 0; k < 8; k++ )
+				crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320UL : crc >> 1;
 		}
 	}
+	return ~crc;
+}
 
-	strcpy( lBuf, strstr(line, "L:") );
-	const char * pch = strtok( lBuf, " " );
-	pch = strtok (NULL," ");
 
-	if(!pch || !*pch)
-	{
-		mItems[chId].mActuators = 0;		// the default Item maps to an actuator, remove this mapping
+// Storage::checkConfig *********************************************
+// ******************************************************************
+// the CRC is taken on the bytes in EEPROM, no copy of the blob
+//
+bool Storage::checkConfig( uint32_t * hash )
+{
+	ConfigBlobHeader h;
+	eeprom_read_block( &h, (const void *)EEPROM_CONFIG_ADDR, sizeof(h) );
 
-		if( mItems[chId].mIsLogging )
-			Serial1.println(" logging only");
-		else
-			Serial1.println(" inactive channel");
+	char s[48];
+	sprintf( s, "EEPROM configuration version %02X revision %02X", h.mVersion, h.mRevision );
+	Serial1.println( s );
 
-		return true;
-	}
+	if( h.mVersion != CONFIG_BLOB_VERSION || h.mRevision != CONFIG_BLOB_REVISION || h.mLength != sizeof(ConfigBlob) )
+		return false;
 
-	Serial1.print(" mLow=");
-	low = atoi(pch);
-	Serial1.print(low);
+	uint16_t crc = 0xFFFF;
 
-	if(!(pch = strtok (NULL," ")))
-	{
-		Serial1.println(" Malformed line");
-		return false;
-	}
+	for( uint16_t i = 0; i < sizeof(ConfigBlob); i++ )
+		crc = _crc16_update( crc, eeprom_read_byte( (const uint8_t *)(EEPROM_CONFIG_ADDR + i) ) );
 
-	Serial1.print(" mHigh=");
-	high = atoi(pch);
-	Serial1.print(high);
+	uint16_t savedCrc;
+	eeprom_read_block( &savedCrc, (const void *)(EEPROM_CONFIG_ADDR + sizeof(ConfigBlob)), sizeof(savedCrc) );
 
-	mItems[chId].mLow = low;
-	mItems[chId].mHigh = high;
+	*hash = h.mSourceHash;
+	return crc == savedCrc;
+}
 
-	if( low > high )
-	{
-		Serial1.println(" mLow is higher than mHigh");
-		return false;
-	}
 
+// Storage::loadConfig **********************************************
+// ******************************************************************
+//
+void Storage::loadConfig( ConfigBlob & blob )
+{
+	eeprom_read_block( &blob, (const void *)EEPROM_CONFIG_ADDR, sizeof(blob) );
+}
 
-	if(!(pch = strtok (NULL," ")))
-	{
-		mItems[chId].mActuators = 0;
-		return true;
-	}
 
-	strcpy(lBuf, line);
-	char * actuators = strstr( lBuf, "A:" );
+// Storage::saveConfig **********************************************
+// ******************************************************************
+// eeprom_update_block skips the bytes that are the same already
+//
+void Storage::saveConfig( ConfigBlob & blob, uint32_t hash )
+{
+	blob.mHeader.mSourceHash = hash;
 
-	if(actuators)
-	{
-		strtok(actuators, " :");
-		const char * a = strtok(NULL, " ");
+	uint16_t crc = 0xFFFF;
+	const uint8_t * p = (const uint8_t *)&blob;
 
-		while(a)
-		{
-			Serial1.print(" A=");
-			int aInt = atoi(a);
+	for( uint16_t i = 0; i < sizeof(blob); i++ )
+		crc = _crc16_update( crc, p[i] );
 
-			if( aInt <= CHANNEL_COUNT && aInt > 0 )
-			{
-				acts |= 1 << (aInt-1);
-				Serial1.print(aInt);
-				Serial1.print(" ");
-				a = strtok(NULL, " ");
-			}
-			else
-			{
-				Serial1.print(aInt);
-				Serial1.println( " <== Actuator value out of range (1..8)" );
-				return false;
-			}
-		}
-		Serial1.println();
+	eeprom_update_block( &blob, (void *)EEPROM_CONFIG_ADDR, sizeof(blob) );
+	eeprom_update_block( &crc, (void *)(EEPROM_CONFIG_ADDR + sizeof(blob)), sizeof(crc) );
+
+	Serial1.println( "Configuration saved to EEPROM" );
+}
+
+
+// Storage::defaultConfig *******************************************
+// ******************************************************************
+// the same as the items the constructor makes. A channel missing
+// in config.txt keeps these
+//
+void Storage::defaultConfig( ConfigBlob & blob )
+{
+	memset( &blob, 0, sizeof(blob) );
+
+	blob.mHeader.mVersion = CONFIG_BLOB_VERSION;
+	blob.mHeader.mRevision = CONFIG_BLOB_REVISION;
+	blob.mHeader.mLength = sizeof(ConfigBlob);
 
-		mItems[chId].mActuators = acts;
+	for( byte i = 0; i < CHANNEL_COUNT; i++ )
+	{
+		ItemConfig & c = blob.mItems[i];
+
+		c.mLow = 20;
+		c.mHigh = 22;
+		c.mActuators = i < ACTUATOR_COUNT ? 1 << i : 0;
+		c.mIsLogging = true;
+		c.mCalibration = 0;
+		c.mMode = control_hysteresis;
+		c.mSensor = ntc_mf52_10k;
+		c.mFilter = filter_none;
+		c.mPeriodMin = AdcChannel::minSamplePeriod / 1000;
+		c.mPeriodMax = AdcChannel::maxSamplePeriod / 1000;
+	}
+
+	for( byte k = 0; k < ACTUATOR_COUNT; k++ )
+	{
+		blob.mRules[k] = Actuator::combine_or;
+		blob.mPriority[k] = NO_CHANNEL;
 	}
-	return true;
 }
 
 
-// Storage::temperatureReading **************************************
+// Storage::applyConfig *********************************************
 // ******************************************************************
+// only the configured fields are taken. The readings, the on times,
+// the toggles, the rollups and the forced states stay. The tables of
+// the sensors given by their parameters are built here, once
 //
-void Storage::temperatureReading(uint8_t item, float t)
+void Storage::applyConfig( const ConfigBlob & blob )
 {
-	mItems[item].Temperature = t + mItems[item].mCalibrationValue;
-	mItems[item].mIsDirty = true;
+	unsigned long now = millis();
+	int16_t * knots[NTC_CUSTOM_COUNT];
 
-	// actuate
-	for(uint8_t actuatorId = 0; actuatorId < CHANNEL_COUNT; actuatorId++)
+	for( byte k = 0; k < NTC_CUSTOM_COUNT; k++ )
+		knots[k] = k < blob.mSensorCount ? ntcBuildTable( blob.mSensors[k] ) : NULL;
+
+	for( byte i = 0; i < CHANNEL_COUNT; i++ )
 	{
-		if(mItems[item].mActuators & (1 << actuatorId))
-		{
-			if(mItems[item].mItemState == Item::forced_on || (mItems[item].mItemState == Item::normal && mItems[item].Temperature <= mItems[item].mLow))
-			{
-				Actuators[actuatorId].activate(item);
+		const ItemConfig & c = blob.mItems[i];
+		uint8_t k = c.mSensor - NTC_TYPE_COUNT;
 
-				if( mItems[item].mIsOn != true )
-				{
-					mItems[item].mToggleCounter++;
-					mItems[item].mIsOn =  true;
-				}
-			}
+		// out of RAM for the table, the default sensor is better than none
+
+		if( c.mSensor >= NTC_TYPE_COUNT && k < NTC_CUSTOM_COUNT && knots[k] )
+			ADCs[i].setCurve( knots[k], blob.mSensors[k].mR0 );
+		else
+			ADCs[i].setSensorType( c.mSensor );
+
+		ADCs[i].setFilter( c.mFilter );
+		ADCs[i].setPeriodBounds( c.mPeriodMin * 1000UL, c.mPeriodMax * 1000UL );
+
+		mItems[i].mLow = c.mLow;
+		mItems[i].mHigh = c.mHigh;
+		mItems[i].mActuators = c.mActuators;
+		mItems[i].mIsLogging = c.mIsLogging;
+		mItems[i].mCalibrationValue = c.mCalibration * 10;
+
+		// the hysteresis and the PWM count the on time their own way. The
+		// on period of the old mode is closed before the new one counts.
+		// The PWM never sets mOnSince, switchItem would add a stale one
+
+		if( mItems[i].mMode != c.mMode )
+		{
+			if( mItems[i].mMode == control_hysteresis )
+				switchItem(i, false, now);
 			else
 			{
-				if(mItems[item].mItemState == Item::forced_off ||  mItems[item].Temperature >= mItems[item].mHigh)
-				{
-					Actuators[actuatorId].deactivate(item);
-
-					if( mItems[item].mIsOn != false )
-					{
-						mItems[item].mToggleCounter++;
-						mItems[item].mIsOn =  false;
-					}
-				}
+				collectPwm();
+				mItems[i].mIsOn = false;		// collectPwm has taken its on time
 			}
+			mDemand[i >> 3] &= ~(1 << (i & 7));
 		}
+
+		setMode(i, c.mMode);
+		mItems[i].mIsDirty = true;
 	}
-}
 
+	memcpy( mRules, blob.mRules, sizeof(mRules) );
+	memcpy( mPriority, blob.mPriority, sizeof(mPriority) );
 
-// Storage::Advance *************************************************
-// ******************************************************************
-// advances to the next active item. If all items are inactive
-// keep the value of mIndex and exit the loop
-//
-void Storage::Advance()
-{
-	// a button press caused advance of the item for displaying. Skip
-	// inactive channels
+	Rules.setProgram( blob.mProgram, blob.mProgramSize );
 
-	if( !mIsAnyActiveChannel )
-		return;
+	// no channel uses the previous tables any more
 
-	do {
-		mIndex = mIndex + 1 == CHANNEL_COUNT ? 0 : mIndex + 1;
-	} while( !ADCs[mIndex].isActive() );
+	for( byte k = 0; k < NTC_CUSTOM_COUNT; k++ )
+	{
+		delete[] mSensorKnots[k];
+		mSensorKnots[k] = knots[k];
+	}
 }
 
 
-bool Storage::LogIfDue( DateTime dt )
+// Storage::activateItems *******************************************
+// ******************************************************************
+// an item that does not drive anything any more is switched off, so
+// that its on time stops
+//
+void Storage::activateItems()
 {
-	mCheckPointsTotal++;
+	unsigned long now = millis();
 
-	for(int i = 0; i < CHANNEL_COUNT; i++ )
-	{
-		if( mItems[i].mIsOn )
-			mItems[i].mCheckPointsActive++;
-	}
+	mIsAnyActiveChannel = false;
 
-	if( mLastLog + LOGGING_INTERVAL < dt.secondstime() )
+	for( byte i = 0; i < CHANNEL_COUNT; i++ )
 	{
-		mLastLog = dt.secondstime();
+		updateThresholds(i);
 
-		for(int i = 0; i < CHANNEL_COUNT; i++ )
+		if( !isDriving(i) )
 		{
-			if( mItems[i].mIsLogging )
-			{
-				char fileName[128];
-				sprintf( fileName, "%d%02dA%d.txt", dt.year(), dt.month(), i + 1);
-
-				Serial1.print( "opening file " );
-				Serial1.println( fileName );
-				File f = SD.open( fileName, FILE_WRITE);
+			mDemand[i >> 3] &= ~(1 << (i & 7));
 
-				if (f)
-				{
-					char buf[128];
-
-					sprintf(buf, "%d%02d%02d %02d00  %dC  duty:%d%%  (%d %s)", dt.year(), dt.month(), dt.day(), dt.hour(),
-							(int)(mItems[i].Temperature),
-							(int)((float)(mItems[i].mCheckPointsActive)/(float)mCheckPointsTotal * 100),
-							(int)mItems[i].mToggleCounter, (mItems[i].mToggleCounter == 1 ? "toggle" : "toggles") );
-
-					if( !f.println(buf) )
-					{
-						Serial1.println( "Failed to log. Is the SD inserted? Do not forget to reset after insertion" );
-						return false;
-					}
-					Serial1.println( buf );
-
-					f.close();
-				} else {
-				// if the file didn't open, print an error:
-					Serial1.print("error opening ");
-					Serial1.print( fileName );
-					Serial1.println(" for writing");
-					return false;
-				}
-			}
+			if( mItems[i].mMode == control_hysteresis )
+				switchItem(i, false, now);
 		}
 
-		mCheckPointsTotal = 0;
+		// activate the corresponding ADC
+
+		if ( mItems[i].mActuators || mItems[i].mIsLogging )
+		{
+			mIsAnyActiveChannel = true;
+			ADCs[i].activate();
+		}
+		else
+			ADCs[i].deactivate();
+	}
+
+	buildIndex();
+
+	// the item on the LCD may be gone
+
+	if( mIsAnyActiveChannel && !ADCs[mIndex].isActive() )
+		Advance();
+}
+
+
+// Storage::reloadConfig ********************************************
+// ******************************************************************
+// the whole file is parsed before anything changes. The rules are
+// compiled in place, their program is kept to go back to. It all
+// happens within one loop pass, between the readings
+//
+bool Storage::reloadConfig( bool isForced )
+{
+	if( !mSDInserted )
+		return true;
+
+	File file = SD.open( "config.txt" );
+
+	if( !file )
+		return true;		// the card is out for editing, nothing changes
+
+	uint32_t size = file.size();
+
+	if( size == mConfigSize && !isForced && ++mConfigPolls < CONFIG_HASH_POLLS )
+	{
+		file.close();
+		return true;
+	}
+
+	mConfigPolls = 0;
+
+	uint32_t hash = hashFile( file );
+
+	mConfigSize = size;
+
+	if( hash == mConfigHash )
+	{
+		file.close();
+		return true;
+	}
+
+	// a file with errors is not parsed again until it changes
+
+	mConfigHash = hash;
+
+	Serial1.println( "config.txt changed, reloading" );
+
+	uint8_t program[RULE_CODE_SIZE];
+	uint8_t programSize = Rules.getProgram( program );
+
+	ConfigBlob shadow;
+	defaultConfig( shadow );
+
+	Rules.clear();
+	file.seek( 0 );
+
+	bool isOk = parseConfig( file, shadow );
+	file.close();
+
+	if( !isOk )
+	{
+		Rules.setProgram( program, programSize );
+		Serial1.println( "config.txt has errors, the configuration is kept" );
+		return false;
+	}
+
+	shadow.mProgramSize = Rules.getProgram( shadow.mProgram );
+
+	applyConfig( shadow );
+	activateItems();
+	saveConfig( shadow, hash );
+
+	Serial1.println( "config.txt reloaded" );
+	return true;
+}
+
+
+// Storage::parseRule ***********************************************
+// ******************************************************************
+// A<y> <OR|AND|MAJ> [P:<x>]
+//
+ConfigStatus_t Storage::parseRule( const ConfigLine & line, uint8_t * at, ConfigBlob & blob )
+{
+	int aId;
+
+	*at = 0;
+
+	if( !ConfigLine::toInt(line.token(0) + 1, &aId) || --aId < 0 || aId >= ACTUATOR_COUNT )
+		return config_actuator;
+
+	*at = 1;
+
+	if( line.is(1, "OR") )
+		blob.mRules[aId] = Actuator::combine_or;
+	else if( line.is(1, "AND") )
+		blob.mRules[aId] = Actuator::combine_and;
+	else if( line.is(1, "MAJ") )
+		blob.mRules[aId] = Actuator::combine_majority;
+	else
+		return config_combine;
+
+	blob.mPriority[aId] = NO_CHANNEL;
+
+	const char * p = line.token(2);
+
+	if( p )
+	{
+		int chId;
+		*at = 2;
+
+		if( memcmp(p, "P:", 2) )
+			return config_unexpected;
+
+		if( !ConfigLine::toInt(p + 2, &chId) || --chId < 0 || chId >= CHANNEL_COUNT )
+			return config_priority;
+
+		blob.mPriority[aId] = chId;
+	}
+
+	if( line.token(3) )
+	{
+		*at = 3;
+		return config_unexpected;
+	}
+	return config_ok;
+}
+
+
+// Storage::buildIndex **********************************************
+// ******************************************************************
+// turns the channel->actuators masks of the items into the
+// actuator->channels lists of the actuators. The lists and the truth
+// tables are built aside, the Timer5 ISR evaluates the actuators. They
+// take them along with the PWM channels at once
+//
+void Storage::buildIndex()
+{
+	Actuator staged[ACTUATOR_COUNT];
+	uint8_t pwm[CHANNEL_MASK_SZ];
+
+	memset( pwm, 0, sizeof(pwm) );
+
+	for( uint8_t i = 0; i < CHANNEL_COUNT; i++ )
+	{
+		if( mItems[i].mMode != control_hysteresis && isDriving(i) )
+			pwm[i >> 3] |= 1 << (i & 7);
+	}
+
+	for( uint8_t a = 0; a < ACTUATOR_COUNT; a++ )
+	{
+		uint8_t inputs[ACTUATOR_MAX_INPUTS];
+		uint8_t count = 0;
+
+		for( uint8_t i = 0; i < CHANNEL_COUNT; i++ )
+		{
+			if( !(mItems[i].mActuators & (1 << a)) || i == mPriority[a] )
+				continue;
+
+			if( count < ACTUATOR_MAX_INPUTS )
+				inputs[count++] = i;
+			else
+			{
+				Serial1.print( "Too many channels for A" );
+				Serial1.print( a + 1 );
+				Serial1.print( ", CH" );
+				Serial1.print( i + 1 );
+				Serial1.println( " ignored" );
+			}
+		}
+
+		// the priority channel takes the last slot if all are used
+
+		if( mPriority[a] != NO_CHANNEL && count == ACTUATOR_MAX_INPUTS )
+			count--;
+
+		staged[a].setInputs(inputs, count);
+		staged[a].setRule(mRules[a], mPriority[a]);
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for( uint8_t a = 0; a < ACTUATOR_COUNT; a++ )
+			Actuators[a].takeIndex( staged[a] );
+
+		for( uint8_t i = 0; i < CHANNEL_COUNT; i++ )
+			Bank.setPwm( i, pwm[i >> 3] & (1 << (i & 7)) );
+	}
+}
+
+
+static const char * const sensorNames[NTC_TYPE_COUNT] = { "MF52", "B57861", "MF58" };
+
+static const char * const filterNames[FILTER_TYPE_COUNT] = { "NONE", "AVG4", "AVG8", "EMA", "MED3", "MED5" };
+
+
+// parseSensor ******************************************************
+// ******************************************************************
+// <R0>/<B> or <R>/<A>/<B>/<C>, the numbers as strtod takes them,
+// e.g. 10000/3950 or 10000/1.129e-3/2.341e-4/8.775e-8
+//
+static bool parseSensor( const char * s, NtcParams * params )
+{
+	double v[4];
+	uint8_t n = 0;
+
+	for( ;; )
+	{
+		char * end;
+
+		v[n++] = strtod( s, &end );
+
+		if( end == s )
+			return false;
+
+		if( !*end )
+			break;
+
+		if( *end != '/' || n == 4 )
+			return false;
+
+		s = end + 1;
+	}
+
+	// the comparisons fail on NaN as well
+
+	if( (n != 2 && n != 4) || !(v[0] >= 100 && v[0] <= 10000000) )
+		return false;
+
+	params->mR0 = v[0];
+
+	if( n == 2 )
+	{
+		if( !(v[1] >= 1000 && v[1] <= 10000) )
+			return false;
+
+		params->mModel = ntc_beta;
+		params->mA = v[1];
+		params->mB = 0;
+		params->mC = 0;
+	}
+	else
+	{
+		if( !(v[1] > 0 && v[2] > 0 && v[3] >= 0) )
+			return false;
+
+		params->mModel = ntc_steinhart;
+		params->mA = v[1];
+		params->mB = v[2];
+		params->mC = v[3];
+	}
+	return true;
+}
+
+
+// parsePeriod ******************************************************
+// ******************************************************************
+// <s> or <min>-<max>, seconds
+//
+static bool parsePeriod( const char * s, uint8_t * minPeriod, uint8_t * maxPeriod )
+{
+	const char * dash = strchr( s, '-' );
+	char low[6];
+	int lo, hi;
+
+	if( dash )
+	{
+		if( dash == s || dash - s >= (int)sizeof(low) )
+			return false;
+
+		memcpy( low, s, dash - s );
+		low[dash - s] = 0;
+
+		if( !ConfigLine::toInt(low, &lo) || !ConfigLine::toInt(dash + 1, &hi) )
+			return false;
+	}
+	else
+	{
+		if( !ConfigLine::toInt(s, &lo) )
+			return false;
+
+		hi = lo;
+	}
+
+	if( lo < 1 || lo > hi || hi > 255 )
+		return false;
+
+	*minPeriod = lo;
+	*maxPeriod = hi;
+	return true;
+}
+
+
+// Storage::parseln *************************************************
+// ******************************************************************
+// CH<x> C<+|-><v> [M:<mode>] [S:<sensor>] [P:<period>] [F:<filter>] L:<ON|OFF>
+//     [<low> <high> [A:<y> ...]]
+// the switches before the limits may come in any order
+//
+ConfigStatus_t Storage::parseln( const ConfigLine & line, uint8_t * at, ConfigBlob & blob )
+{
+	int chId;
+
+	*at = 0;
+
+	if( !ConfigLine::toInt(line.token(0) + 2, &chId) || --chId < 0 || chId >= CHANNEL_COUNT )
+		return config_channel;
+
+	ItemConfig & item = blob.mItems[chId];
+	bool isCalibrated = false;
+	bool isLogging = false;
+	uint8_t mode = control_hysteresis;
+	uint8_t i = 1;
+	const char * tok;
+
+	for( ; (tok = line.token(i)) != NULL; i++ )
+	{
+		*at = i;
+
+		if( tok[0] == 'C' && (tok[1] == '+' || tok[1] == '-') )
+		{
+			int cal;
+
+			if( !ConfigLine::toInt(tok + 1, &cal) || cal < -128 || cal > 127 )
+				return config_calibration;
+
+			item.mCalibration = cal;
+			isCalibrated = true;
+		}
+		else if( !memcmp(tok, "M:", 2) )
+		{
+			if( !strcmp(tok + 2, "HYS") )
+				mode = control_hysteresis;
+			else if( !strcmp(tok + 2, "TP") )
+				mode = control_proportional;
+			else if( !strcmp(tok + 2, "PID") )
+				mode = control_pid;
+			else
+				return config_mode;
+		}
+		else if( !memcmp(tok, "S:", 2) )
+		{
+			uint8_t type = 0;
+
+			while( type < NTC_TYPE_COUNT && strcmp(tok + 2, sensorNames[type]) )
+				type++;
+
+			if( type == NTC_TYPE_COUNT )
+			{
+				// given by its parameters. The channels with the same
+				// parameters share the table
+
+				NtcParams params;
+				uint8_t k = 0;
+
+				if( !parseSensor(tok + 2, &params) )
+					return config_sensor;
+
+				while( k < blob.mSensorCount && memcmp(&blob.mSensors[k], &params, sizeof(params)) )
+					k++;
+
+				if( k == NTC_CUSTOM_COUNT )
+					return config_sensors_full;
+
+				if( k == blob.mSensorCount )
+					blob.mSensors[blob.mSensorCount++] = params;
+
+				type = NTC_TYPE_COUNT + k;
+			}
+			item.mSensor = type;
+		}
+		else if( !memcmp(tok, "P:", 2) )
+		{
+			if( !parsePeriod(tok + 2, &item.mPeriodMin, &item.mPeriodMax) )
+				return config_period;
+		}
+		else if( !memcmp(tok, "F:", 2) )
+		{
+			uint8_t type = 0;
+
+			while( type < FILTER_TYPE_COUNT && strcmp(tok + 2, filterNames[type]) )
+				type++;
+
+			if( type == FILTER_TYPE_COUNT )
+				return config_filter;
+
+			item.mFilter = type;
+		}
+		else if( !strcmp(tok, "L:ON") || !strcmp(tok, "L:OFF") )
+		{
+			item.mIsLogging = tok[3] == 'N';
+			isLogging = true;
+		}
+		else
+			break;
+	}
+
+	*at = i;
+
+	if( !isCalibrated )
+		return config_calibration;
+
+	if( !isLogging )
+		return config_logging;
+
+	item.mMode = mode;
+
+	// the default Item maps to an actuator, no limits remove this mapping
+
+	item.mActuators = 0;
+
+	if( !tok )
+		return config_ok;		// logging only or inactive
+
+	int low, high;
+
+	if( !ConfigLine::toInt(tok, &low) || low < -128 || low > 127 )
+		return config_number;
+
+	*at = ++i;
+
+	if( !ConfigLine::toInt(line.token(i), &high) || high < -128 || high > 127 )
+		return config_number;
+
+	if( low > high )
+		return config_limits;
+
+	item.mLow = low;
+	item.mHigh = high;
+
+	tok = line.token(++i);
+
+	if( !tok )
+		return config_ok;
+
+	*at = i;
+
+	if( memcmp(tok, "A:", 2) )
+		return config_unexpected;
+
+	// A:1 2 or A: 1 2
+
+	uint8_t acts = 0;		// bit mask of the controlled actuators
+	const char * a = tok[2] ? tok + 2 : line.token(++i);
+
+	for( ; a; a = line.token(++i) )
+	{
+		int aInt;
+		*at = i;
+
+		if( !ConfigLine::toInt(a, &aInt) )
+			return config_number;
+
+		if( aInt < 1 || aInt > ACTUATOR_COUNT )
+			return config_actuator;
+
+		acts |= 1 << (aInt - 1);
+	}
+
+	item.mActuators = acts;
+	return config_ok;
+}
+
+
+// Storage::temperatureReading **************************************
+// ******************************************************************
+//
+void Storage::temperatureReading(uint8_t item, uint16_t reading)
+{
+	mItems[item].mReading = reading;
+	mItems[item].mIsConverted = false;
+	mItems[item].mIsDirty = true;
+	mItems[item].mRollup.fold(reading);
+
+	// no conversion here, the thresholds are in readings. The higher the
+	// reading, the lower the temperature
+
+	bool isCold = reading >= mItems[item].mOnReading;
+	bool isWarm = reading < mItems[item].mOffReading;
+
+	// no actuators, nothing to decide. The actuators themselves are
+	// evaluated by the bank, from mDemand, once per tick
+
+	if( !isDriving(item) )
+		return;
+
+	Item::ItemState_t state = getControlState(item);
+
+	if( mItems[item].mMode != control_hysteresis )
+	{
+		// the duty cycle goes to the bank, it runs the actuators. See collectPwm
+
+		uint8_t duty;
+
+		if( state == Item::forced_on || state == Item::forced_off )
+		{
+			duty = state == Item::forced_on ? DUTY_MAX : 0;
+
+			if( mItems[item].mPid )
+				mItems[item].mPid->reset();
+		}
+		else
+		{
+			duty = computeDuty(item);
+		}
+
+		mItems[item].mDuty = duty;
+		Bank.setDuty(item, duty);
+		return;
+	}
+
+	bool isOn;
+
+	if(state == Item::forced_on || (state == Item::normal && isCold))
+		isOn = true;
+	else if(state == Item::forced_off || isWarm)
+		isOn = false;
+	else
+		return;				// between the thresholds, keep the state
+
+	if( isOn )
+		mDemand[item >> 3] |= 1 << (item & 7);
+	else
+		mDemand[item >> 3] &= ~(1 << (item & 7));
+
+	switchItem(item, isOn, millis());
+}
+
+
+// Storage::switchItem **********************************************
+// ******************************************************************
+//
+void Storage::switchItem(uint8_t item, bool isOn, unsigned long now)
+{
+	if( mItems[item].mIsOn == isOn )
+		return;
+
+	if( isOn )
+		mItems[item].mOnSince = now;
+	else
+		mItems[item].mOnTime += now - mItems[item].mOnSince;
+
+	mItems[item].mToggleCounter++;
+	mItems[item].mIsOn = isOn;
+}
+
+
+// Storage::takeOnTime **********************************************
+// ******************************************************************
+// the period still open is cut at now and goes on from there. The
+// PWM items are accounted by collectPwm
+//
+unsigned long Storage::takeOnTime(uint8_t item, unsigned long now)
+{
+	unsigned long t = mItems[item].mOnTime;
+
+	if( mItems[item].mIsOn && mItems[item].mMode == control_hysteresis )
+	{
+		t += now - mItems[item].mOnSince;
+		mItems[item].mOnSince = now;
+	}
+	mItems[item].mOnTime = 0;
+
+	return t;
+}
+
+
+// Storage::peekOnTime **********************************************
+// ******************************************************************
+//
+unsigned long Storage::peekOnTime(uint8_t item, unsigned long now)
+{
+	unsigned long t = mItems[item].mOnTime;
+
+	if( mItems[item].mIsOn && mItems[item].mMode == control_hysteresis )
+		t += now - mItems[item].mOnSince;
+
+	return t;
+}
+
+
+// Storage::computeDuty ********************************************
+// ******************************************************************
+// the limits and the set point are where the hysteresis would have
+// them, calibration and the shift of the rules included
+//
+uint8_t Storage::computeDuty(uint8_t item)
+{
+	int16_t t = getTemperature(item);
+	int16_t low = mItems[item].mLow * 100 + mItems[item].mShift;
+	int16_t high = mItems[item].mHigh * 100 + mItems[item].mShift;
+
+	if( mItems[item].mMode == control_pid && mItems[item].mPid )
+		return mItems[item].mPid->update((low + high) / 2, t, millis());
+
+	// time proportional, 100% at the low limit down to 0% at the high one
+
+	if( t <= low )
+		return DUTY_MAX;
+	if( t >= high )
+		return 0;
+
+	return (long)(high - t) * DUTY_MAX / (high - low);
+}
+
+
+// Storage::setMode *************************************************
+// ******************************************************************
+// the PID state is only allocated for the channels that need it
+//
+void Storage::setMode(uint8_t item, uint8_t mode)
+{
+	if( mode >= CONTROL_MODE_COUNT )
+		mode = control_hysteresis;
+
+	mItems[item].mMode = static_cast<ControlMode_t>(mode);
+
+	if( mode == control_pid && !mItems[item].mPid )
+		mItems[item].mPid = new PidControl();
+
+	if( mode != control_pid && mItems[item].mPid )
+	{
+		delete mItems[item].mPid;
+		mItems[item].mPid = NULL;
+	}
+}
+
+
+// Storage::collectPwm **********************************************
+// ******************************************************************
+//
+void Storage::collectPwm()
+{
+	for( uint8_t i = 0; i < CHANNEL_COUNT; i++ )
+	{
+		if( mItems[i].mMode == control_hysteresis )
+			continue;
+
+		// the PWM counts in whole ticks, which is its resolution
+
+		uint16_t onTicks;
+		uint8_t toggles = Bank.takeActivity(i, &onTicks);
+
+		mItems[i].mOnTime += onTicks * 1000UL;
+
+		if( toggles )
+		{
+			mItems[i].mToggleCounter += toggles;
+			mItems[i].mIsOn = Bank.getPwmOut(i);
+			mItems[i].mIsDirty = true;
+		}
+	}
+}
+
+
+// Storage::isDriving ***********************************************
+// ******************************************************************
+// a priority channel drives its actuator even if it is not in the
+// actuator list of the channel
+//
+bool Storage::isDriving(uint8_t item)
+{
+	if( mItems[item].mActuators )
+		return true;
+
+	for( uint8_t a = 0; a < ACTUATOR_COUNT; a++ )
+	{
+		if( mPriority[a] == item )
+			return true;
+	}
+	return false;
+}
+
+
+// Storage::applyRules **********************************************
+// ******************************************************************
+// takes over the outcome of a complete run of the rules
+//
+void Storage::applyRules()
+{
+	for( uint8_t i = 0; i < CHANNEL_COUNT; i++ )
+	{
+		mItems[i].mRuleState = static_cast<Item::ItemState_t>(Rules.getState(i));
+
+		if( mItems[i].mShift != Rules.getShift(i) )
+		{
+			mItems[i].mShift = Rules.getShift(i);
+			updateThresholds(i);
+		}
+	}
+}
+
+
+// Storage::getTemperature *****************************************
+// ******************************************************************
+// the reading is converted the first time it is asked for
+//
+int16_t Storage::getTemperature(int index)
+{
+	if( !mItems[index].mIsConverted )
+	{
+		mItems[index].Temperature = toTemperature(index, mItems[index].mReading);
+		mItems[index].mIsConverted = true;
+	}
+	return mItems[index].Temperature;
+}
+
+
+// Storage::toTemperature ******************************************
+// ******************************************************************
+//
+int16_t Storage::toTemperature(uint8_t item, uint16_t reading)
+{
+	return ADCs[item].convert(reading) + mItems[item].mCalibrationValue;
+}
+
+
+// Storage::updateThresholds ****************************************
+// ******************************************************************
+//
+void Storage::updateThresholds(int index)
+{
+	int16_t cal = mItems[index].mCalibrationValue - mItems[index].mShift;
+
+	// on:  T + cal <= mLow,  i.e. T <= mLow - cal
+	// off: T + cal >= mHigh, i.e. not T <= mHigh - cal - 1
+
+	mItems[index].mOnReading = ADCs[index].readingAtOrBelow(mItems[index].mLow * 100 - cal);
+	mItems[index].mOffReading = ADCs[index].readingAtOrBelow(mItems[index].mHigh * 100 - cal - 1);
+}
+
+
+// Storage::getMargin **********************************************
+// ******************************************************************
+//
+int16_t Storage::getMargin(uint8_t item)
+{
+	if( !isDriving(item) || getControlState(item) != Item::normal )
+		return 0x7FFF;
+
+	int16_t toLow = abs((int16_t)(mItems[item].mReading - mItems[item].mOnReading));
+	int16_t toHigh = abs((int16_t)(mItems[item].mReading - mItems[item].mOffReading));
+
+	return toLow < toHigh ? toLow : toHigh;
+}
+
+
+// Storage::Advance *************************************************
+// ******************************************************************
+// advances to the next active item. If all items are inactive
+// keep the value of mIndex and exit the loop
+//
+void Storage::Advance()
+{
+	// a button press caused advance of the item for displaying. Skip
+	// inactive channels
+
+	if( !mIsAnyActiveChannel )
+		return;
+
+	do {
+		mIndex = mIndex + 1 == CHANNEL_COUNT ? 0 : mIndex + 1;
+	} while( !ADCs[mIndex].isActive() );
+}
+
+
+// dutyOf ***********************************************************
+// ******************************************************************
+// in one hundredth of percent. In seconds, so that the product fits
+// up to 119 h of on time. A second of an hour period is 0.03 %. The
+// on time replayed from a checkpoint can be a few ms over the period
+//
+static uint16_t dutyOf(unsigned long onTime, unsigned long period)
+{
+	period /= 1000;
+
+	if( !period )
+		return 0;
+
+	unsigned long duty = onTime / 1000 * 10000 / period;
+	return duty < 10000 ? (uint16_t)duty : 10000;
+}
+
+
+// Storage::LogIfDue ************************************************
+// ******************************************************************
+// see logRecord.h for the format and tools/logdecode.cpp to read it
+//
+bool Storage::LogIfDue( DateTime dt )
+{
+	if( mLastCheckpoint + JOURNAL_PERIOD <= (long)dt.secondstime() )
+	{
+		mLastCheckpoint = dt.secondstime();
+		mIsCheckpointDue = true;
+	}
+
+	if( mLastLog + LOGGING_INTERVAL < dt.secondstime() )
+	{
+		mLastLog = dt.secondstime();
+
+		// the accumulators are reset below, the checkpoint has to
+		// follow, or a reset would log the period twice
+
+		mLastCheckpoint = mLastLog;
+		mIsCheckpointDue = true;
+
+		// the duty is the on time over the length of the period, both
+		// in ms. The PWM is collected up to now first
+
+		collectPwm();
+
+		unsigned long now = millis();
+		unsigned long period = now - mIntervalStart;
+		mIntervalStart = now;
+
+		// all the channels go to the file of the month, one record each.
+		// They are only queued here, see serviceLog
+
+		bool isOk = true;
+		uint8_t records = 0;
+
+		LogRecord r;
+		r.mTime = dt.unixtime();
 
 		for(int i = 0; i < CHANNEL_COUNT; i++ )
 		{
-			mItems[i].mCheckPointsActive = 0;
+			unsigned long onTime = takeOnTime(i, now);
+
+			if( mItems[i].mIsLogging )
+			{
+				r.mChannel = i;
+				r.mFlags = (mItems[i].mIsOn ? log_flag_on : 0)
+						| (mItems[i].mItemState != Item::normal ? log_flag_forced : 0)
+						| (mItems[i].mRuleState != Item::normal ? log_flag_rule : 0)
+						| (mItems[i].mMode << log_flag_mode_shift);
+				r.mTemperature = getTemperature(i);
+				r.mBelow = 0;
+				r.mAbove = 0;
+
+				// the period's statistics, if the channel was sampled
+
+				Rollup & rollup = mItems[i].mRollup;
+
+				if( !rollup.isEmpty() )
+				{
+					// the higher the reading, the lower the temperature
+
+					r.mTemperature = toTemperature(i, rollup.getAverageReading());
+					int below = (r.mTemperature - toTemperature(i, rollup.getMaxReading())) / ROLLUP_DELTA_UNIT;
+					int above = (toTemperature(i, rollup.getMinReading()) - r.mTemperature) / ROLLUP_DELTA_UNIT;
+					r.mBelow = constrain(below, 0, 255);
+					r.mAbove = constrain(above, 0, 255);
+				}
+				r.mDuty = dutyOf(onTime, period);
+				r.mToggles = mItems[i].mToggleCounter;
+				r.mCrc = logRecordCrc(&r);
+
+				isOk = mLog.push( r, dt.year(), dt.month() ) && isOk;
+				records++;
+			}
+
+			// the history is kept for all the channels, logging or not
+
+			if( !mItems[i].mRollup.isEmpty() )
+				mItems[i].mRollup.close( toTemperature(i, mItems[i].mRollup.getAverageReading()) );
+
 			mItems[i].mToggleCounter = 0;
 		}
 
-		return true;
+		// the actuators
+
+		for( uint8_t a = 0; a < ACTUATOR_COUNT; a++ )
+		{
+			uint16_t toggles;
+			unsigned long onTime = Bank.takeOnTime(a, now, &toggles);
+
+			r.mChannel = LOG_RECORD_ACTUATOR | a;
+			r.mFlags = Bank.getState() & (1 << a) ? log_flag_on : 0;
+			r.mTemperature = 0;
+			r.mBelow = 0;
+			r.mAbove = 0;
+			r.mDuty = dutyOf(onTime, period);
+			r.mToggles = toggles;
+			r.mCrc = logRecordCrc(&r);
+
+			isOk = mLog.push( r, dt.year(), dt.month() ) && isOk;
+			records++;
+		}
+
+		Serial1.print( records );
+		Serial1.print( " records queued, dropped so far " );
+		Serial1.print( mLog.getDropped() );
+		Serial1.print( ", worst slice " );
+		Serial1.print( mLog.getWorstSlice() );
+		Serial1.print( " us, overruns " );
+		Serial1.print( mLog.getOverruns() );
+		Serial1.print( ", peak " );
+		Serial1.println( mLog.getPeak() );
+
+		return isOk;
+	}
+	return true;
+}
+
+
+// Storage::serviceLog *********************************************
+// ******************************************************************
+// the checkpoint is started with the queue idle and the queue is not
+// drained till it is committed, so the pending records stay where
+// they are. A full sector waits in the queue meanwhile
+//
+bool Storage::serviceLog()
+{
+	if( mCheckpointStep == checkpoint_idle )
+	{
+		if( mSDInserted && !mJournal.isOpen() && millis() - mJournalRetry >= JOURNAL_RETRY_MS )
+		{
+			mJournalRetry = millis();
+
+			if( mJournal.begin() )
+				Serial1.println( JOURNAL_FILE " open again" );
+			return true;
+		}
+
+		if( !mIsCheckpointDue || !mLog.isIdle() )
+			return mLog.drain();
+
+		mIsCheckpointDue = false;
+
+		collectPwm();
+
+		mCheckpointStep = checkpoint_file_size;
+		mCheckpointAt = millis();
+		mCheckpointLog = mLastLog;
+		mPendingLength = mLog.getPending( &mPending, &mPendingMonth );
 	}
+
+	// a failed checkpoint is told by the journal, the log is not
+	// concerned. The latest one stays
+
+	unsigned long start = micros();
+
+	while( checkpoint() && mCheckpointStep != checkpoint_idle && micros() - start < LOG_SLICE_US )
+		;
+
 	return true;
 }
 
 
+// Storage::checkpoint **********************************************
+// ******************************************************************
+// the records of the sector being filled go with it. The size of the
+// file tells at replay if they made it to the card since.
+// The entries are taken as they are written, up to a few passes
+// after mElapsed. The time the checkpoint takes, a few ms
+//
+bool Storage::checkpoint()
+{
+	// the accumulators were reset by LogIfDue, the rest of the
+	// checkpoint would be of the next period. It is due again
+
+	if( mLastLog != mCheckpointLog )
+	{
+		mCheckpointStep = checkpoint_idle;
+		return true;
+	}
+
+	bool isOk = true;
+
+	switch( mCheckpointStep )
+	{
+	case checkpoint_file_size:
+		mPendingFileSize = mPendingLength ? mLog.getFileSize( mPendingMonth ) : 0;
+		mCheckpointStep = checkpoint_header;
+		break;
+
+	case checkpoint_header:
+	{
+		Checkpoint c;
+
+		c.mChannels = CHANNEL_COUNT;
+		c.mLastLog = mCheckpointLog;
+		c.mElapsed = mCheckpointAt - mIntervalStart;
+		c.mPending = mPendingLength;
+		c.mMonth = mPendingMonth;
+		c.mFileSize = mPendingFileSize;
+
+		isOk = mJournal.start() && mJournal.add( &c, sizeof(c) );
+		mCheckpointStep = checkpoint_channels;
+		mCheckpointPos = 0;
+		break;
+	}
+
+	case checkpoint_channels:
+	{
+		ChannelCheckpoint cc;
+		uint8_t i = mCheckpointPos;
+		Rollup & rollup = mItems[i].mRollup;
+
+		cc.mOnTime = peekOnTime(i, millis());
+		cc.mToggles = mItems[i].mToggleCounter;
+		cc.mMin = rollup.getMinReading();
+		cc.mMax = rollup.getMaxReading();
+		cc.mSum = rollup.getSum();
+		cc.mCount = rollup.getCount();
+
+		isOk = mJournal.add( &cc, sizeof(cc) );
+
+		if( ++mCheckpointPos == CHANNEL_COUNT )
+		{
+			mCheckpointStep = checkpoint_actuators;
+			mCheckpointPos = 0;
+		}
+		break;
+	}
+
+	case checkpoint_actuators:
+	{
+		ActuatorCheckpoint ac;
+		uint16_t toggles;
+
+		ac.mOnTime = Bank.peekOnTime(mCheckpointPos, millis(), &toggles);
+		ac.mToggles = toggles;
+		isOk = mJournal.add( &ac, sizeof(ac) );
+
+		if( ++mCheckpointPos == ACTUATOR_COUNT )
+		{
+			mCheckpointStep = checkpoint_records;
+			mCheckpointPos = 0;
+		}
+		break;
+	}
+
+	case checkpoint_records:
+		if( mCheckpointPos < mPendingLength )
+		{
+			uint16_t len = mPendingLength - mCheckpointPos < sizeof(LogRecord) ? mPendingLength - mCheckpointPos : sizeof(LogRecord);
+
+			isOk = mJournal.add( mPending + mCheckpointPos, len );
+			mCheckpointPos += len;
+		}
+		if( mCheckpointPos >= mPendingLength )
+			mCheckpointStep = checkpoint_sync;
+		break;
+
+	case checkpoint_sync:
+		isOk = mJournal.sync();
+		mCheckpointStep = checkpoint_commit;
+		break;
+
+	case checkpoint_commit:
+		isOk = mJournal.commit();
+		mCheckpointStep = checkpoint_idle;
+
+		if( isOk )
+		{
+			Serial1.print( "Checkpoint " );
+			Serial1.print( mJournal.getSequence() );
+			Serial1.print( " in " );
+			Serial1.print( millis() - mCheckpointAt );
+			Serial1.println( " ms" );
+		}
+		break;
+
+	default:
+		mCheckpointStep = checkpoint_idle;
+		break;
+	}
+
+	if( !isOk )
+		mCheckpointStep = checkpoint_idle;
+
+	return isOk;
+}
+
+
+// Storage::replay **************************************************
+// ******************************************************************
+// the checkpoint is the state of the period at the time it was
+// written. What happened from then on till the reset is lost, the
+// time the device was off is not part of the period
+//
+void Storage::replay()
+{
+	Checkpoint c;
+
+	if( !mJournal.open() || !mJournal.read( &c, sizeof(c) ) )
+		return;
+
+	if( c.mChannels != CHANNEL_COUNT )
+	{
+		Serial1.println( "Checkpoint of another channel count, ignored" );
+		return;
+	}
+
+	mLastLog = c.mLastLog;
+	mIntervalStart = millis() - c.mElapsed;
+
+	for( uint8_t i = 0; i < CHANNEL_COUNT; i++ )
+	{
+		ChannelCheckpoint cc;
+
+		if( !mJournal.read( &cc, sizeof(cc) ) )
+			return;
+
+		mItems[i].mOnTime = cc.mOnTime;
+		mItems[i].mToggleCounter = cc.mToggles;
+
+		if( cc.mCount )
+			mItems[i].mRollup.restore( cc.mMin, cc.mMax, cc.mSum, cc.mCount );
+	}
+
+	for( uint8_t a = 0; a < ACTUATOR_COUNT; a++ )
+	{
+		ActuatorCheckpoint ac;
+
+		if( !mJournal.read( &ac, sizeof(ac) ) )
+			return;
+
+		Bank.restoreOnTime( a, ac.mOnTime, ac.mToggles );
+	}
+
+	// the pending records go back to the queue, unless the sector
+	// they were in was written after the checkpoint
+
+	uint8_t requeued = 0;
+
+	if( c.mPending && mLog.getFileSize( c.mMonth ) == c.mFileSize )
+	{
+		LogRecord r;
+
+		for( uint16_t n = 0; n < c.mPending && mJournal.read( &r, sizeof(r) ); n += sizeof(r) )
+		{
+			if( mLog.push( r, c.mMonth / 12, c.mMonth % 12 + 1 ) )
+				requeued++;
+		}
+	}
+
+	Serial1.print( "Checkpoint " );
+	Serial1.print( mJournal.getSequence() );
+	Serial1.print( " replayed, " );
+	Serial1.print( requeued );
+	Serial1.println( " records queued again" );
+}
+
+
 // Storage::setItemState ********************************************
 // ******************************************************************
 // this is a special setter. It not only updates the mItem but
-// updates the value in EEPROM
+// the state ring. The EEPROM is written later by serviceState
 //
 void Storage::setItemState(int index, Item::ItemState_t itemState)
 {
 	mItems[index].mItemState = itemState;
 	mItems[index].mIsDirty = true;
-	// find the relevant item in EEPROM and update only this byte
 
-	EEPROM.write( 2 + index * EEPROM_ITEM_SZ + 5, itemState);
+	mStates.set( index, itemState );
 }
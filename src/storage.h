@@ -15,9 +15,33 @@
 #define STORAGE_H_
 
 #include "RTClib.h"
-
-#define CHANNEL_COUNT 8
-#define EEPROM_ITEM_SZ 6
+#include "shield.h"
+#include "pidControl.h"
+#include "logQueue.h"
+#include "rollup.h"
+#include "ntcTable.h"
+#include "journal.h"
+#include "configReader.h"
+#include "stateRing.h"
+
+#define EEPROM_CONFIG_ADDR 0		// the parsed configuration, see Storage::saveConfig
+#define EEPROM_STATE_ADDR 1024		// the forced states, a ring up to the end, see StateRing
+#define EEPROM_STATE_END (E2END + 1)
+#define JOURNAL_PERIOD 300		// seconds between the checkpoints
+#define JOURNAL_RETRY_MS 60000	// between the attempts to open the journal again after an SD error
+#define CONFIG_HASH_POLLS 5		// reloadConfig calls between the hashes of an unchanged size
+
+//! the pieces of a checkpoint, in the order they are written. See Storage::checkpoint
+typedef enum CheckpointStep {
+	checkpoint_idle,
+	checkpoint_file_size,
+	checkpoint_header,
+	checkpoint_channels,
+	checkpoint_actuators,
+	checkpoint_records,
+	checkpoint_sync,
+	checkpoint_commit
+} CheckpointStep_t;
 
 
 struct Item
@@ -28,9 +52,18 @@ struct Item
 		forced_on
 	} ItemState_t;
 
-	float Temperature;
+	int16_t Temperature;		//!< in one hundredth of centigrade, calibration applied. Valid if mIsConverted
+	uint16_t mReading;			//!< the latest reading of the ADC channel, not converted
+	bool mIsConverted;			//!< Temperature is up to date with mReading
 	int mLow;
 	int mHigh;
+
+	/*! the thresholds turned into readings, calibration included. The temperature
+	 *  falls as the reading grows, so the item is on at mOnReading and above, off
+	 *  below mOffReading. See Storage::updateThresholds
+	 */
+	uint16_t mOnReading;
+	uint16_t mOffReading;
 	bool mIsDirty;			//!< the new value has not been displayed
 	uint8_t mActuators;		//!< bit 0 - Actuator 0, bit 7 - actuator 7
 	bool mIsOn;				//!< checks if the trigger conditions are satisfied
@@ -38,18 +71,30 @@ struct Item
 	bool mIsLogging;
 
 	/*! this is an accumulator of activation
-	 *  It is the owner that decides when to reset the accumulator. It is a counter
-	 *  stepped up if the Item is found active at the check-point. The owner resets it once per logging period.
-	 *  The logging period consists of an arbitrary number of check-points. The logger should use this total
-	 *  count of check-points and the activity accumulator in order to calculate the active/total ratio
+	 *  The time the Item was on within the current logging period (ms). The on and off edges are
+	 *  timestamped as they happen, see Storage::switchItem. The logger divides it by the length of the
+	 *  period and resets it.
 	 */
-	long mCheckPointsActive;
+	unsigned long mOnTime;
+
+	unsigned long mOnSince;		//!< millis() of the latest on edge, valid while mIsOn
 
 	long mToggleCounter;
 
-	float mCalibrationValue;	//!< the calibration value for the temperature for this channel, e.g. -0.5
+	int16_t mCalibrationValue;	//!< the calibration value for the temperature for this channel, e.g. -50 (-0.5C)
+
+	int16_t mShift;				//!< the thresholds moved by the rules, in one hundredth of centigrade
+	ItemState_t mRuleState;		//!< forced by the rules, see RuleVm. mItemState takes precedence
+
+	Rollup mRollup;				//!< the readings of the logging period and the history
+
+	ControlMode_t mMode;
+	PidControl * mPid;			//!< NULL unless in the PID mode
+	uint8_t mDuty;				//!< 0...DUTY_MAX, the latest duty cycle unless in the hysteresis mode
 };
 
+struct ConfigBlob;
+
 class Storage
 {
 public:
@@ -65,30 +110,135 @@ public:
 	 * it just takes the items as is (default).
 	 *
 	 * once the configuration is selected, it tries to store it both on SD and EEPROM.
+	 * The EEPROM keeps the parsed configuration along with the hash of the config.txt
+	 * it came from. If the config.txt has the same hash at the next boot, it is not
+	 * parsed, the configuration is loaded from EEPROM. The EEPROM is only written
+	 * when the configuration changes.
 	 *
 	 * if the SD is inserted but no config.txt exists, the default config.txt is created
 	 *
-	 * @return     Returns false on parsing errors only
+	 * A config.txt with errors is not taken. The configuration in EEPROM, or else
+	 * the default one, is used and the storage is started all the same. The
+	 * corrected file is taken by reloadConfig.
+	 *
+	 * @return     Returns false on errors in config.txt only, see getConfigError
 	 */
 	bool begin();
 
+	/*!
+	 * @brief      What stopped begin, the line and the column in config.txt
+	 */
+	const ConfigError & getConfigError() { return mConfigError; }
+
+	/*!
+	 * @brief      Takes config.txt again if it changed, no reset needed.
+	 *
+	 * The size of the file is compared at every call, its hash every
+	 * CONFIG_HASH_POLLS calls or if forced. A changed file is parsed into a
+	 * shadow configuration first. The items only take it if there are no
+	 * errors, all at once. Their accumulators, rollups and forced states stay,
+	 * the logging period goes on.
+	 *
+	 * Shall be called in idle time, e.g. once a minute.
+	 *
+	 * @param[in]  isForced hash the file whatever its size
+	 * @return     false if the new file has errors and is not taken, see getConfigError
+	 */
+	bool reloadConfig(bool isForced);
+
 	void Advance();		// advance the mIndex, will be displayed
-	void temperatureReading(uint8_t item, float t);
+	/*!
+	 * @brief      Takes a new reading of the item's ADC channel and actuates.
+	 *
+	 * The reading is compared with the thresholds as is. It is only converted to
+	 * temperature when somebody asks for it, see getTemperature.
+	 */
+	void temperatureReading(uint8_t item, uint16_t reading);
+
+
+	/*!
+	 * @brief      Distance of the latest temperature to the nearest threshold.
+	 *
+	 * Used to adapt the sampling period of the channel.
+	 *
+	 * @return     In readings, 0x7FFF if the item does not control anything or
+	 *             is forced
+	 */
+	int16_t getMargin(uint8_t item);
+
+	/*!
+	 * @brief      What the channels want from their actuators.
+	 *
+	 * Bit i is set if the channel i wants its actuators on. The actuators combine
+	 * the bits of their channels according to their rules, see Actuator::evaluate.
+	 *
+	 * @return     CHANNEL_MASK_SZ bytes, channel 0 is bit 0 of the first byte
+	 */
+	const uint8_t * getDemand() { return mDemand; }
 
+	/*!
+	 * @brief      Takes the shifts and forced states of a complete run of the rules.
+	 *
+	 * Shall be called whenever RuleVm::run returns true.
+	 */
+	void applyRules();
 
+	/*!
+	 * @brief      Takes the switching done by the PWM into mIsOn and mToggleCounter.
+	 *
+	 * Only concerns the items in the proportional or PID mode. Shall be called
+	 * once per loop pass.
+	 */
+	void collectPwm();
+
+	/*!
+	 * @brief      Queues the records of the period if it is over.
+	 *
+	 * Shall be called every minute or so. Does not touch the SD card. Also
+	 * tells serviceLog when a checkpoint is due, every JOURNAL_PERIOD and right
+	 * after the records are queued.
+	 *
+	 * @return     false if records were dropped, the queue is full
+	 */
 	bool LogIfDue( DateTime );
+
+	/*!
+	 * @brief      Writes the queued records to the SD card, a slice at a time.
+	 *
+	 * Shall be called once per loop pass. A checkpoint due is started once no
+	 * sector waits for the card. It takes the passes of its own it needs,
+	 * about LOG_SLICE_US each, the queue waits till it is committed. A journal
+	 * closed by an SD error is opened again every JOURNAL_RETRY_MS, in a pass
+	 * of its own.
+	 *
+	 * @return     false if a write failed
+	 */
+	bool serviceLog();
+
+	/*!
+	 * @brief      Writes the changed forced states to EEPROM, a byte at a time.
+	 *
+	 * Shall be called once per loop pass. Never waits for the EEPROM.
+	 */
+	void serviceState() { mStates.service(); }
 	bool isAnyActiveChannel() { return mIsAnyActiveChannel; }	//!< returns true if there is at least one active channel
 
 
 	//! Item accessors
 
-	void setTemperature(int index, float t) { mItems[index].Temperature = t; }
-	float getTemperature(int index) { return mItems[index].Temperature; }
+	int16_t getTemperature(int index);		//!< one hundredth of centigrade, converted on demand
 
-	void setLow(int index, int mLow) { mItems[index].mLow = mLow; }
+	/*!
+	 * @brief      The average temperature of a past logging period
+	 * @param[in]  age 0 for the latest complete one, up to ROLLUP_DEPTH - 1
+	 * @return     one hundredth of centigrade, ROLLUP_NONE if not kept
+	 */
+	int16_t getHistory(int index, uint8_t age) { return mItems[index].mRollup.getHistory(age); }
+
+	void setLow(int index, int mLow) { mItems[index].mLow = mLow; updateThresholds(index); }
 	int getLow(int index) { return mItems[index].mLow;  }
 
-	void setHigh(int index, int mHigh) { mItems[index].mHigh = mHigh; }
+	void setHigh(int index, int mHigh) { mItems[index].mHigh = mHigh; updateThresholds(index); }
 	int getHigh(int index) { return mItems[index].mHigh;  }
 
 	void setDirty(int index, bool isDirty) { mItems[index].mIsDirty = isDirty; }
@@ -97,9 +247,12 @@ public:
 	void setActuators(int index, uint8_t as) {  mItems[index].mActuators = as; }
 	uint8_t getActuators(int index) {  return mItems[index].mActuators; }
 
-	void setIsOn(int index, bool isOn) {  mItems[index].mIsOn = isOn; }
+	void setIsOn(int index, bool isOn) {  switchItem(index, isOn, millis()); }
 	bool getIsOn(int index) {  return mItems[index].mIsOn; }
 
+	ControlMode_t getMode(int index) { return mItems[index].mMode; }
+	uint8_t getDuty(int index) { return mItems[index].mDuty; }		//!< unless in the hysteresis mode
+
 	void setItemState(int index, Item::ItemState_t mItemState);
 	Item::ItemState_t getItemState(int index) { return mItems[index].mItemState; }
 
@@ -113,14 +266,113 @@ private:
 	Item mItems[CHANNEL_COUNT];
 
 private:
-	bool parseln(const char*);
+	bool parseConfig(File & file, ConfigBlob & blob);		//!< into the blob, false on errors, see getConfigError
+	uint32_t createConfig();			//!< writes the default config.txt, returns its hash
+	uint32_t hashFile(File & file);		//!< CRC-32 of the rest of the file
+
+	bool checkConfig(uint32_t * hash);	//!< true if the EEPROM has a valid configuration, of the config.txt with the hash
+	void loadConfig(ConfigBlob & blob);						//!< from EEPROM, valid if checkConfig
+	void saveConfig(ConfigBlob & blob, uint32_t hash);		//!< to EEPROM, the bytes that changed
+	void defaultConfig(ConfigBlob & blob);
+	void applyConfig(const ConfigBlob & blob);				//!< the items and the rules take it
+	void activateItems();		//!< the thresholds, the ADCs and the actuators follow the items
+
+	ConfigStatus_t parseln(const ConfigLine & line, uint8_t * at, ConfigBlob & blob);		//!< a CH line, at is the word in error
+	ConfigStatus_t parseRule(const ConfigLine & line, uint8_t * at, ConfigBlob & blob);	//!< an A line
+
+	bool isDriving(uint8_t item);		//!< true if the item drives any actuator
+
+	/*!
+	 * @brief      Turns the item on or off and accounts for it.
+	 *
+	 * Counts the toggle and adds the closed on period to mOnTime.
+	 */
+	void switchItem(uint8_t item, bool isOn, unsigned long now);
+
+	/*!
+	 * @brief      Closes the on time of the item at now, for the logger.
+	 * @return     The on time of the period so far (ms)
+	 */
+	unsigned long takeOnTime(uint8_t item, unsigned long now);
+	unsigned long peekOnTime(uint8_t item, unsigned long now);	//!< same, the period goes on
+
+	/*!
+	 * @brief      Saves the accumulators of the logging period to the journal.
+	 *
+	 * The on times, the toggles, the rollups of the items and the actuators,
+	 * mLastLog and the records not on the card yet. See replay.
+	 *
+	 * Writes the next piece of the checkpoint started by serviceLog, at most
+	 * one SD operation: the size of the file of the records, an entry of the
+	 * body, the sync of the body or the header.
+	 *
+	 * @return     false if the journal could not be written. The checkpoint is dropped
+	 */
+	bool checkpoint();
+
+	/*!
+	 * @brief      Takes the latest checkpoint back after a reset. Called by begin
+	 */
+	void replay();
+
+	uint8_t computeDuty(uint8_t item);		//!< the duty cycle for the latest reading
+	int16_t toTemperature(uint8_t item, uint16_t reading);	//!< converted, calibration applied
+	void setMode(uint8_t item, uint8_t mode);
+
+	//! the forced state by the button, or else by the rules
+	Item::ItemState_t getControlState(uint8_t item) { return mItems[item].mItemState != Item::normal ? mItems[item].mItemState : mItems[item].mRuleState; }
+
+	/*!
+	 * @brief      Hands the channels driving each actuator and its rule to the actuator.
+	 *
+	 * The PWM channels go to the bank along with them, in one atomic swap.
+	 *
+	 * Has to be called whenever the actuators of any item or the rules change.
+	 */
+	void buildIndex();
+
+	/*!
+	 * @brief      Turns the thresholds of the item into readings.
+	 *
+	 * Has to be called whenever the thresholds, the calibration or the sensor of
+	 * the item change.
+	 */
+	void updateThresholds(int index);
+
+	LogQueue mLog;				//!< the records waiting for the SD card
+
+	Journal mJournal;			//!< the checkpoints, see checkpoint
+	long mLastCheckpoint;		//!< RTC seconds the latest checkpoint was asked for
+	bool mIsCheckpointDue;
+	unsigned long mJournalRetry;	//!< millis() of the latest attempt to open the journal
+	CheckpointStep_t mCheckpointStep;	//!< the next piece of the checkpoint being written
+	uint16_t mCheckpointPos;	//!< the next item, actuator or byte of records of the step
+	unsigned long mCheckpointAt;	//!< millis() it was started at, the end of the period so far
+	long mCheckpointLog;		//!< mLastLog then. The checkpoint is dropped if the period is over
+	const uint8_t * mPending;	//!< the records of the sector being filled then
+	uint16_t mPendingLength;
+	uint16_t mPendingMonth;
+	uint32_t mPendingFileSize;	//!< of the file of the month then
+
+	StateRing mStates;			//!< the forced states in EEPROM
 
 	bool mSDInserted;
+	uint32_t mConfigHash;		//!< of the config.txt the items come from
+	uint32_t mConfigSize;
+	uint8_t mConfigPolls;		//!< since the latest hash, see reloadConfig
+	int16_t * mSensorKnots[NTC_CUSTOM_COUNT];	//!< the tables of the sensors given by their parameters, see applyConfig
+	ConfigError mConfigError;
 	long mLastLog;
 
 	bool mIsAnyActiveChannel;
 
-	long mCheckPointsTotal;
+	unsigned long mIntervalStart;		//!< millis() when the current logging period started
+
+	uint8_t mDemand[CHANNEL_MASK_SZ];		//!< see getDemand
+
+	uint8_t mRules[ACTUATOR_COUNT];			//!< Actuator::CombineRule_t of each actuator
+
+	uint8_t mPriority[ACTUATOR_COUNT];		//!< the channel forcing the actuator on, NO_CHANNEL for none
 };
 
 
@@ -9,11 +9,16 @@
 #include "SD.h"
 #include "button.h"
 #include "adcChannel.h"
+#include "adcEngine.h"
+#include "sensorBus.h"
+#include "ad5165_dPot.h"
 #include <LiquidCrystal_I2C.h>
 #include <Wire.h>
 #include <RTClib.h>
 #include "storage.h"
 #include "actuator.h"
+#include "actuatorBank.h"
+#include "ruleVm.h"
 
 
 // CONSTANTS
@@ -25,13 +30,31 @@ static const char daysOfTheWeek[7][12] = {"Sunday", "Monday", "Tuesday", "Wednes
 
 Button b(BUTTON_PIN);
 
-AdcChannel ADCs[8];
+AdcChannel ADCs[CHANNEL_COUNT];
+
+AdcEngine Adc;
+
+// a loop pass takes up to LOG_SLICE_US on the SD card, and the rest of the loop
+// on top of it. A channel alone in the scan gets a result every ADC_CONVERSION_US,
+// its ring has to hold all of them till the next drain
+
+typedef char AdcRingSizeCheck[(ADC_RING_SIZE - 1) * ADC_CONVERSION_US >= LOG_SLICE_US * 3 / 2 ? 1 : -1];
+
+SensorBus Bus;
+
+#ifdef DPOT_FITTED
+AD5165 Pot(DPOT_CS_PIN);
+#endif
 
 LiquidCrystal_I2C	lcd(0x27,2,1,0,4,5,6,7); // 0x27 is the I2C bus address for an unmodified backpack
 
 RTC_DS1307 rtc;
 
-Actuator Actuators[8];
+Actuator Actuators[ACTUATOR_COUNT];
+
+ActuatorBank Bank;
+
+RuleVm Rules;
 
 Storage Store;
 int CurrentIndex = -1;
@@ -39,6 +62,8 @@ unsigned long notTooOftenCounter = 0;
 
 bool ForceADCReadout = false;
 
+//#define CHECK_NTC_TABLE			// uncomment to print the table lookup next to the float calculation
+
 int freeRam ();
 
 
@@ -64,16 +89,30 @@ void setup()
 
 	// initializing ADC channels. The channels 0...7 are assigned to the
 	// pins A0...A7. Note that the display and the config.txt files, as well as
-	// the shield's silk layer use enumeration 1 to 8
+	// the shield's silk layer use enumeration 1 to 8. With the multiplexer
+	// the channels 8...15 are the bank 1 on the same pins, and so on
+
+	for( int i = 0; i < CHANNEL_COUNT; i++ )
+	{
+		ADCs[i] = AdcChannel(A0 + i % ADC_PIN_COUNT);
+	}
+	Bus.begin();
 
-	ADCs[0] = AdcChannel(A0);
-	ADCs[1] = AdcChannel(A1);
-	ADCs[2] = AdcChannel(A2);
-	ADCs[3] = AdcChannel(A3);
-	ADCs[4] = AdcChannel(A4);
-	ADCs[5] = AdcChannel(A5);
-	ADCs[6] = AdcChannel(A6);
-	ADCs[7] = AdcChannel(A7);
+#ifdef DPOT_FITTED
+	// all the channels share the pot, they are sampled one at a time
+
+	Pot.begin();
+
+	for( int i = 0; i < CHANNEL_COUNT; i++ )
+	{
+		ADCs[i].setPot(&Pot);
+	}
+#endif
+
+	// from now on the ADC runs in the background. The channels
+	// enable it while they need the samples
+
+	Adc.begin();
 
 	// initializing actuators. The Id is 0 to 7, a bit number in
 	// actuator byte of the ADC channel. The mapping to the pin is
@@ -88,6 +127,10 @@ void setup()
 	Actuators[6] = Actuator(6, true);
 	Actuators[7] = Actuator(7, false);		// the last actuator is not connected through ULN2003 but directly
 
+	// the pins are driven by the bank, all at once
+
+	Bank.begin();
+
 	// The Real Time Clock
 
 	rtc.begin();			// returns bool, but is never false
@@ -120,6 +163,8 @@ void setup()
     Serial1.print(now.second(), DEC);
     Serial1.println();
 
+    Rules.setTime(now.hour() * 60 + now.minute());
+
 	// activate LCD module
 	lcd.begin (16,2); // for 16 x 2 LCD module
 	lcd.setBacklightPin(3,POSITIVE);
@@ -132,6 +177,18 @@ void setup()
 	if(!Store.begin())
 	{
 		Serial1.println("Error initializing the storage");
+
+		const ConfigError & e = Store.getConfigError();
+
+		if( e.mStatus != config_ok )
+		{
+			Serial1.print( "config.txt line " );
+			Serial1.print( e.mLine );
+			Serial1.print( " column " );
+			Serial1.print( e.mColumn );
+			Serial1.print( ": " );
+			Serial1.println( configStatusText(e.mStatus) );
+		}
 		digitalWrite( ALARM_LED_PIN, HIGH );
 	}
 	Serial1.print( "RAM after Storage.begin " );
@@ -185,17 +242,53 @@ void loop()
 
 	}
 
-	// ADC sampling
+	// R on the debugging port takes config.txt at once
 
-	for(int i = 0; i < CHANNEL_COUNT; i++ )
+	if( Serial1.available() && Serial1.read() == 'R' )
 	{
-		AdcChannel * ch = &ADCs[i];
-		if( ch->isActive() && ( ForceADCReadout || ch->isDue() ))
-		{
-			Store.temperatureReading(i, ch->getTemperature());
-		}
+		if( !Store.reloadConfig(true) )
+			digitalWrite( ALARM_LED_PIN, HIGH );
 	}
-	ForceADCReadout = false;
+
+	// ADC sampling. The bus advances the sampling cycle once per pass
+	// and never blocks
+
+	if( ForceADCReadout )
+	{
+		Bus.requestAll();
+		ForceADCReadout = false;
+	}
+
+	int sampled = Bus.poll();
+
+	if( sampled >= 0 )
+	{
+		AdcChannel * ch = &ADCs[sampled];
+
+#ifdef CHECK_NTC_TABLE
+		// compare the table lookup with the float calculation
+		Serial1.print( ch->convert(ch->getReading()) );
+		Serial1.print( " vs " );
+		Serial1.println( ch->getTemperature(AdcChannel::R0, AdcChannel::B) * 100.0 );
+#endif
+		Store.temperatureReading(sampled, ch->getReading());
+		ch->reschedule(Store.getMargin(sampled));
+	}
+
+	// the rules run a few instructions per pass. Once through, the
+	// items take the outcome
+
+	if( Rules.run() )
+		Store.applyRules();
+
+	// the switching done by the PWM in the background
+
+	Store.collectPwm();
+
+	// whatever the readings of this pass changed goes to the relays now,
+	// in one port write
+
+	Bank.commit(Store.getDemand());
 
 	// update LCD display if necessary
 
@@ -207,11 +300,17 @@ void loop()
 			lcd.home (); // set cursor to 0,0
 
 			char buf[32];
-			float t = Store.getTemperature(Store.mIndex);
-			int intPart = t;
-			unsigned int fractPart = abs((t - (float)intPart)*10.0);
+			int16_t t = Store.getTemperature(Store.mIndex);		// one hundredth of centigrade
+			unsigned int absT = abs(t);
+
+			char state[8];
+
+			if( Store.getMode(Store.mIndex) == control_hysteresis )
+				strcpy( state, Store.getIsOn(Store.mIndex) ? "ON     " : "OFF    " );
+			else
+				sprintf( state, "%3u%%   ", (unsigned int)Store.getDuty(Store.mIndex) * 100 / DUTY_MAX );
 
-			sprintf( buf, "CH%d %d.%01dC %s", CurrentIndex + 1, intPart, fractPart, Store.getIsOn(Store.mIndex) ? "ON     " : "OFF    ");
+			sprintf( buf, "CH%d %s%u.%01uC %s", CurrentIndex + 1, t < 0 ? "-" : "", absT / 100, (absT % 100) / 10, state );
 			Store.setDirty(Store.mIndex, false);
 			lcd.print( buf );
 			lcd.setCursor (0,1);        // go to start of 2nd line
@@ -231,7 +330,7 @@ void loop()
 			// list controlled actuators
 			lcd.print("A:");
 
-			for( int i = 0; i < CHANNEL_COUNT; i++ )
+			for( int i = 0; i < ACTUATOR_COUNT; i++ )
 			{
 				if( Store.getActuators(Store.mIndex) & (1 << i) )
 				{
@@ -250,6 +349,15 @@ void loop()
 	}
 
 
+	// the log queue goes to the SD card a slice at a time
+
+	if( !Store.serviceLog() )
+		digitalWrite( ALARM_LED_PIN, HIGH );
+
+	// the forced states go to EEPROM a byte per pass, not from the button
+
+	Store.serviceState();
+
 	// log the data if time comes. Protect against wrap around
 
 	unsigned long ms = millis();
@@ -258,11 +366,18 @@ void loop()
 		notTooOftenCounter = millis();
 
 		DateTime now = rtc.now();
+		Rules.setTime(now.hour() * 60 + now.minute());
+
 		if( !Store.LogIfDue( now ) )
 		{
-			Serial1.println("No logging. The write attempt failed. Is the SD inserted? Insert and reset!");
+			Serial1.println("No logging. The log queue is full. Is the SD inserted? Insert and reset!");
 			digitalWrite( ALARM_LED_PIN, HIGH );
 		}
+
+		// a changed config.txt is taken without a reset
+
+		if( !Store.reloadConfig(false) )
+			digitalWrite( ALARM_LED_PIN, HIGH );
 	}
 
 }
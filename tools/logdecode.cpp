@@ -0,0 +1,158 @@
+/*******************************************************************************
+ ******************************* Copyright 2016 ********************************
+ *******************************************************************************
+ *
+ * Host tool: converts the binary log files (YYYYMM.LOG) to text
+ *
+ *   g++ -o logdecode tools/logdecode.cpp
+ *   logdecode [-csv|-text] 201610.LOG [...]     (stdin if no file is given)
+ *
+ * -csv (default) prints one line per record with full precision:
+ *   date,time,channel,temperature,min,max,duty,toggles,on,forced,rule,mode
+ * The temperature is the average of the hour
+ * -text prints the format the firmware used to write:
+ *   20161017 1300  CH1  21C  duty:35%  (4 toggles)
+ *
+ * Records with a bad CRC are reported on stderr and skipped. The padding
+ * the firmware puts in front of the sectors is skipped silently. The files
+ * are preallocated for the month, only the sectors the headers count as
+ * written are read. The files of the older firmware have no headers and are
+ * read to the end.
+ *
+ * Created on: 		2016-10-20
+ * Modified on:
+ * Author:			Mikhail Soloviev
+ *
+ *******************************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../src/logRecord.h"
+
+static const char * modeNames[] = { "HYS", "TP", "PID", "?" };
+static const long RECORDS_PER_SECTOR = 512 / sizeof(LogRecord);
+
+
+// printRecord ******************************************************
+// ******************************************************************
+//
+static void printRecord(const LogRecord & r, bool isCsv)
+{
+	// the RTC keeps the local time, no time zone to apply
+	time_t t = r.mTime;
+	struct tm * tm = gmtime(&t);
+
+	char date[16];
+	strftime(date, sizeof(date), "%Y%m%d", tm);
+
+	char channel[8];
+	if( r.mChannel & LOG_RECORD_ACTUATOR )
+		sprintf(channel, "OUT%d", (r.mChannel & ~LOG_RECORD_ACTUATOR) + 1);
+	else
+		sprintf(channel, "CH%d", r.mChannel + 1);
+
+	if( isCsv )
+	{
+		printf("%s,%02d:%02d,%s,%.2f,%.1f,%.1f,%.2f,%u,%d,%d,%d,%s\n", date, tm->tm_hour, tm->tm_min, channel,
+				r.mTemperature / 100.0, r.mTemperature / 100.0 - r.mBelow / 10.0, r.mTemperature / 100.0 + r.mAbove / 10.0,
+				r.mDuty / 100.0, r.mToggles,
+				(r.mFlags & log_flag_on) != 0, (r.mFlags & log_flag_forced) != 0, (r.mFlags & log_flag_rule) != 0,
+				modeNames[(r.mFlags & log_flag_mode_mask) >> log_flag_mode_shift]);
+	}
+	else
+	{
+		if( r.mChannel & LOG_RECORD_ACTUATOR )
+			printf("%s %02d00  %s  duty:%d%%  (%u %s)\n", date, tm->tm_hour, channel,
+					r.mDuty / 100, r.mToggles, r.mToggles == 1 ? "toggle" : "toggles");
+		else
+			printf("%s %02d00  %s  %dC  duty:%d%%  (%u %s)\n", date, tm->tm_hour, channel, r.mTemperature / 100,
+					r.mDuty / 100, r.mToggles, r.mToggles == 1 ? "toggle" : "toggles");
+	}
+}
+
+
+// decode ***********************************************************
+// ******************************************************************
+//
+static int decode(FILE * f, const char * name, bool isCsv)
+{
+	LogRecord r;
+	long n = 0;
+	int bad = 0;
+	long end = -1;			// records in the file, -1 up to EOF
+	bool isPreallocated = false;
+	uint16_t written = 0;
+
+	while( (end < 0 || n < end) && fread(&r, sizeof(r), 1, f) == 1 )
+	{
+		// the headers are the first records of the first sectors
+
+		if( n < LOG_FILE_HEADERS * RECORDS_PER_SECTOR && n % RECORDS_PER_SECTOR == 0 )
+		{
+			LogFileHeader h;
+			memcpy(&h, &r, sizeof(h));
+
+			if( isLogFileHeader(&h) )
+			{
+				isPreallocated = true;
+				if( h.mWritten > written )
+					written = h.mWritten;
+			}
+		}
+
+		if( isPreallocated && n == LOG_FILE_HEADERS * RECORDS_PER_SECTOR )
+		{
+			end = n + written * RECORDS_PER_SECTOR;
+			if( n >= end )
+				break;
+		}
+
+		if( r.mChannel == LOG_RECORD_FILLER )
+			;		// no such channel, the padding
+		else if( logRecordCrc(&r) != r.mCrc )
+		{
+			fprintf(stderr, "%s: record %ld has a bad CRC, skipped\n", name, n);
+			bad++;
+		}
+		else
+			printRecord(r, isCsv);
+		n++;
+	}
+	return bad;
+}
+
+
+int main(int argc, char ** argv)
+{
+	bool isCsv = true;
+	int files = 0;
+	int bad = 0;
+
+	for( int i = 1; i < argc; i++ )
+	{
+		if( !strcmp(argv[i], "-csv") )
+			isCsv = true;
+		else if( !strcmp(argv[i], "-text") )
+			isCsv = false;
+		else
+		{
+			FILE * f = fopen(argv[i], "rb");
+
+			if( !f )
+			{
+				fprintf(stderr, "cannot open %s\n", argv[i]);
+				return 2;
+			}
+			bad += decode(f, argv[i], isCsv);
+			fclose(f);
+			files++;
+		}
+	}
+
+	if( !files )
+		bad += decode(stdin, "stdin", isCsv);
+
+	return bad ? 1 : 0;
+}